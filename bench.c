@@ -1,10 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include "vikalloc.h"
 
+// Each build variant (see vikalloc.h) is benchmarked by building this
+// file against it and comparing with the runtime switchable build:
+//   gcc -O2 bench.c vikalloc.c -o bench
+//   gcc -O2 -DVIKALLOC_PRODUCTION bench.c vikalloc.c -o bench_production
+//   gcc -O2 -DVIKALLOC_QUIET bench.c vikalloc.c -o bench_quiet
+
 #define NUM_ITERATIONS 1000000
 #define SIZE 32
+#define NUM_LIVE 1000
+#define MAX_MIXED_SIZE 1024
+#define SEARCH_BLOCKS 200000
+#define SEARCH_ROUNDS 200
+#define THREAD_ITERATIONS 200000
+#define THREAD_LIVE 64
+#define HANDOFF_RING 1024
+#define STREAM_BUFFER (64 << 20)
+#define STREAM_ROUNDS 8
+#define HOT_SET (256 << 10)
+#define GROW_START (1 << 20)
+#define GROW_END ((size_t) 256 << 20)
+
+static unsigned long bench_seed = 1;
+
+// A small LCG so every run (and every variant) sees the same sizes.
+static unsigned bench_rand(void) {
+    bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (unsigned) (bench_seed >> 33);
+}
+
+void print_variant() {
+    printf("variant:");
+#ifdef VIKALLOC_PRODUCTION
+    printf(" production");
+#endif
+#ifdef VIKALLOC_QUIET
+    printf(" quiet");
+#endif
+#ifdef VIKALLOC_FIXED_FIT
+    printf(" fixed-fit");
+#endif
+#ifdef VIKALLOC_FIXED_FREE_LIST
+    printf(" fixed-free-list");
+#endif
+#ifdef NDEBUG
+    printf(" no-assert");
+#endif
+    printf(" runtime-checks=%s\n",
+#if defined(VIKALLOC_QUIET) && defined(VIKALLOC_FIXED_FIT) && defined(VIKALLOC_FIXED_FREE_LIST)
+           "none"
+#else
+           "some"
+#endif
+        );
+}
 
 void benchmark_vikalloc() {
     clock_t start, end;
@@ -36,8 +90,327 @@ void benchmark_malloc() {
     printf("malloc time: %f seconds\n", cpu_time_used);
 }
 
+// Random sizes with up to NUM_LIVE blocks live at once, so the search,
+// split and coalesce paths all get used.
+void benchmark_vikalloc_mixed() {
+    static void *ptrs[NUM_LIVE];
+    clock_t start, end;
+    double cpu_time_used;
+
+    bench_seed = 1;
+    start = clock();
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        unsigned slot = bench_rand() % NUM_LIVE;
+        if (ptrs[slot]) {
+            vikfree(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            ptrs[slot] = vikalloc(1 + bench_rand() % MAX_MIXED_SIZE);
+        }
+    }
+    end = clock();
+    for (int i = 0; i < NUM_LIVE; i++) {
+        vikfree(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+
+    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    printf("vikalloc mixed time: %f seconds\n", cpu_time_used);
+}
+
+// A heap of SEARCH_BLOCKS blocks with every other one freed in random
+// order, so the LIFO free list jumps all over the heap. None of the free
+// blocks fit the requests, so without the search hint every search walks
+// the whole list.
+void benchmark_vikalloc_search(uint8_t side_table, uint8_t prefetch, uint8_t hint) {
+    static void *ptrs[SEARCH_BLOCKS];
+    clock_t start, end;
+    double cpu_time_used;
+
+    bench_seed = 1;
+    vikalloc_set_free_list_order(FREE_LIST_LIFO);
+    vikalloc_set_side_table(side_table);
+    vikalloc_set_prefetch(prefetch);
+    vikalloc_set_search_hint(hint);
+    for (int i = 0; i < SEARCH_BLOCKS; i++) {
+        ptrs[i] = vikalloc(16 + bench_rand() % 240);
+    }
+    for (int i = SEARCH_BLOCKS - 1; i > 0; i--) {
+        unsigned j = bench_rand() % (i + 1);
+        void *tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+    for (int i = 0; i < SEARCH_BLOCKS / 2; i++) {
+        vikfree(ptrs[i]);
+    }
+
+    start = clock();
+    for (int i = 0; i < SEARCH_ROUNDS; i++) {
+        vikalloc(4040);
+    }
+    end = clock();
+    vikalloc_reset();
+    vikalloc_set_search_hint(TRUE);
+    vikalloc_set_prefetch(FALSE);
+    vikalloc_set_side_table(FALSE);
+    vikalloc_set_free_list_order(FREE_LIST_ADDRESS);
+
+    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    printf("vikalloc search time (%s, prefetch %s, hint %s): %f seconds\n"
+           , side_table ? "side table" : "inline", prefetch ? "on" : "off"
+           , hint ? "on" : "off", cpu_time_used);
+}
+
+static void *thread_worker(void *arg) {
+    void *ptrs[THREAD_LIVE] = {NULL};
+    unsigned long seed = (unsigned long) arg;
+
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        unsigned slot = 0;
+
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        slot = (seed >> 33) % THREAD_LIVE;
+        if (ptrs[slot]) {
+            vikfree(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            ptrs[slot] = vikalloc(1 + (seed >> 40) % CACHE_MAX_SIZE);
+        }
+    }
+    for (int i = 0; i < THREAD_LIVE; i++) {
+        vikfree(ptrs[i]);
+    }
+    return NULL;
+}
+
+// Small objects from num_threads threads at once. Wall time, since the
+// threads run in parallel, and the heap size, which is where the memory
+// held by the caches at their peak ends up (thread caches are flushed as
+// their threads exit).
+// Per-thread caches cost memory per thread, per-CPU ones per core.
+void benchmark_vikalloc_threads(vikalloc_cache_mode_t mode, int num_threads) {
+    static pthread_t threads[1024];
+    struct timespec start, end;
+    vikalloc_stats_t stats;
+    double wall_time_used;
+
+    vikalloc_set_cache_mode(mode);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, thread_worker, (void *) (unsigned long) (i + 1));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    vikalloc_get_stats(&stats);
+    vikalloc_set_cache_mode(CACHE_NONE);
+    vikalloc_reset();
+
+    wall_time_used = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("vikalloc %d threads (%s caches): %f seconds, heap %zu bytes, cached %zu bytes\n"
+           , num_threads, CACHE_CPU == mode ? "cpu" : "thread", wall_time_used
+           , stats.heap_bytes, stats.cache_bytes);
+}
+
+static void *handoff_ring[HANDOFF_RING];
+static unsigned long handoff_head, handoff_tail;
+
+static void *handoff_consumer(void *arg) {
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        void *ptr = NULL;
+
+        while (__atomic_load_n(&handoff_tail, __ATOMIC_ACQUIRE) == handoff_head) {
+            sched_yield();
+        }
+        ptr = handoff_ring[handoff_head % HANDOFF_RING];
+        __atomic_store_n(&handoff_head, handoff_head + 1, __ATOMIC_RELEASE);
+        vikfree(ptr);
+    }
+    return arg;
+}
+
+// One thread only allocates and another only frees what it is handed,
+// so without the transfer cache every block would go through the heap.
+void benchmark_vikalloc_handoff(vikalloc_cache_mode_t mode) {
+    struct timespec start, end;
+    vikalloc_stats_t stats;
+    pthread_t consumer;
+    double wall_time_used;
+
+    vikalloc_set_cache_mode(mode);
+    handoff_head = handoff_tail = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&consumer, NULL, handoff_consumer, NULL);
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        while (handoff_tail - __atomic_load_n(&handoff_head, __ATOMIC_ACQUIRE) == HANDOFF_RING) {
+            sched_yield();
+        }
+        handoff_ring[handoff_tail % HANDOFF_RING] = vikalloc(SIZE);
+        __atomic_store_n(&handoff_tail, handoff_tail + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(consumer, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    vikalloc_get_stats(&stats);
+    vikalloc_set_cache_mode(CACHE_NONE);
+    vikalloc_reset();
+
+    wall_time_used = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("vikalloc handoff (%s caches): %f seconds, heap %zu bytes, in transfer %zu bytes\n"
+           , CACHE_CPU == mode ? "cpu" : "thread", wall_time_used
+           , stats.heap_bytes, stats.transfer_bytes);
+}
+
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static volatile unsigned hot_sink;
+
+// Reads every cache line of the hot set.
+static void touch_hot(const unsigned char *hot) {
+    unsigned sum = 0;
+
+    for (int i = 0; i < HOT_SET; i += 64) {
+        sum += hot[i];
+    }
+    hot_sink = sum;
+}
+
+// vikcalloc() and a vikrealloc() that has to move STREAM_BUFFER bytes,
+// with the stores going through the caches (stream_min 0) or around
+// them. Reports the bandwidth of each, and how long reading a warm
+// HOT_SET of other data takes afterwards, which goes up with the
+// number of its lines the big operation evicted.
+void benchmark_vikalloc_stream(size_t stream_min) {
+    static unsigned char hot[HOT_SET];
+    struct timespec start, end;
+    double calloc_time = 0;
+    double realloc_time = 0;
+    double hot_time = 0;
+
+    // The buffer has to be copied, not remapped.
+    vikalloc_set_large_min(0);
+    vikalloc_set_stream_min(stream_min);
+    for (int i = 0; i < HOT_SET; i++) {
+        hot[i] = (unsigned char) i;
+    }
+    for (int i = 0; i < STREAM_ROUNDS; i++) {
+        unsigned char *ptr = NULL;
+
+        touch_hot(hot);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ptr = vikcalloc(1, STREAM_BUFFER);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        calloc_time += elapsed(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        touch_hot(hot);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        hot_time += elapsed(&start, &end);
+
+        touch_hot(hot);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ptr = vikrealloc(ptr, STREAM_BUFFER + 4096);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        realloc_time += elapsed(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        touch_hot(hot);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        hot_time += elapsed(&start, &end);
+        vikfree(ptr);
+    }
+    vikalloc_reset();
+    vikalloc_set_stream_min(STREAM_MIN_SIZE);
+    vikalloc_set_large_min(LARGE_MIN_SIZE);
+
+    printf("vikalloc stream (%s): calloc %.2f GB/s, realloc %.2f GB/s"
+           ", hot set reread %.1f us\n"
+           , stream_min ? "non-temporal" : "cached"
+           , STREAM_ROUNDS * (double) STREAM_BUFFER / calloc_time / 1e9
+           , STREAM_ROUNDS * (double) STREAM_BUFFER / realloc_time / 1e9
+           , hot_time * 1e6 / (2 * STREAM_ROUNDS));
+}
+
+// A buffer that doubles from GROW_START to GROW_END bytes, writing its
+// new half each time, like a growing column. Large objects grow with
+// mremap(); in the heap every step copies everything so far.
+void benchmark_vikalloc_grow(size_t large_min) {
+    struct timespec start, end;
+    vikalloc_stats_t stats;
+    char *ptr = NULL;
+    size_t size = GROW_START;
+
+    vikalloc_set_large_min(large_min);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ptr = vikalloc(size);
+    memset(ptr, 1, size);
+    while (size < GROW_END) {
+        ptr = vikrealloc(ptr, size * 2);
+        memset(ptr + size, 1, size);
+        size *= 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    vikalloc_get_stats(&stats);
+    vikfree(ptr);
+    vikalloc_reset();
+    vikalloc_set_large_min(LARGE_MIN_SIZE);
+
+    printf("vikalloc grow to %zu MB (%s): %f seconds, heap %zu bytes, remaps %zu\n"
+           , GROW_END >> 20, large_min ? "large objects" : "heap only"
+           , elapsed(&start, &end), stats.heap_bytes, stats.large_remaps);
+}
+
+void benchmark_malloc_mixed() {
+    static void *ptrs[NUM_LIVE];
+    clock_t start, end;
+    double cpu_time_used;
+
+    bench_seed = 1;
+    start = clock();
+    for (int i = 0; i < NUM_ITERATIONS; i++) {
+        unsigned slot = bench_rand() % NUM_LIVE;
+        if (ptrs[slot]) {
+            free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            ptrs[slot] = malloc(1 + bench_rand() % MAX_MIXED_SIZE);
+        }
+    }
+    end = clock();
+    for (int i = 0; i < NUM_LIVE; i++) {
+        free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+
+    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    printf("malloc mixed time: %f seconds\n", cpu_time_used);
+}
+
 int main() {
+    print_variant();
+    // The malloc() runs go last, since malloc() can also move the program
+    // break that vikalloc() grows with sbrk().
     benchmark_vikalloc();
+    benchmark_vikalloc_mixed();
+    benchmark_vikalloc_search(FALSE, FALSE, FALSE);
+    benchmark_vikalloc_search(FALSE, TRUE, FALSE);
+    benchmark_vikalloc_search(TRUE, FALSE, FALSE);
+    benchmark_vikalloc_search(TRUE, TRUE, FALSE);
+    benchmark_vikalloc_search(FALSE, FALSE, TRUE);
+    benchmark_vikalloc_threads(CACHE_THREAD, 4);
+    benchmark_vikalloc_threads(CACHE_CPU, 4);
+    benchmark_vikalloc_threads(CACHE_THREAD, 64);
+    benchmark_vikalloc_threads(CACHE_CPU, 64);
+    benchmark_vikalloc_handoff(CACHE_THREAD);
+    benchmark_vikalloc_handoff(CACHE_CPU);
+    benchmark_vikalloc_stream(0);
+    benchmark_vikalloc_stream(STREAM_MIN_SIZE);
+    benchmark_vikalloc_grow(0);
+    benchmark_vikalloc_grow(LARGE_MIN_SIZE);
     benchmark_malloc();
+    benchmark_malloc_mixed();
     return 0;
 }
@@ -6,6 +6,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 //#define NDEBUG
 #include <assert.h>
@@ -94,6 +98,27 @@ void stress5(int);
 
 void strdup1(int);
 
+void hugepages1(int);
+void purge1(int);
+void medium1(int);
+void sidetable1(int);
+void pool1(int);
+void heaps1(int);
+void buffer1(int);
+void shared1(int);
+void file1(int);
+void checkpoint1(int);
+void compact1(int);
+void cache1(int);
+void transfer1(int);
+void maint1(int);
+void hint1(int);
+void firstfit1(int);
+void stream1(int);
+void shrink1(int);
+void large1(int);
+void sizeclass1(int);
+
 static void init_streams(void) __attribute__((constructor));
 
 static void 
@@ -283,6 +308,27 @@ next_fit_tests(void)
     VIKTEST(32,stress3);
     VIKTEST(33,stress4);
     VIKTEST(34,stress5);
+
+    VIKTEST(35,hugepages1);
+    VIKTEST(36,purge1);
+    VIKTEST(37,medium1);
+    VIKTEST(38,sidetable1);
+    VIKTEST(39,pool1);
+    VIKTEST(40,heaps1);
+    VIKTEST(41,buffer1);
+    VIKTEST(42,shared1);
+    VIKTEST(43,file1);
+    VIKTEST(44,checkpoint1);
+    VIKTEST(45,compact1);
+    VIKTEST(46,cache1);
+    VIKTEST(47,transfer1);
+    VIKTEST(48,maint1);
+    VIKTEST(49,hint1);
+    VIKTEST(50,firstfit1);
+    VIKTEST(51,stream1);
+    VIKTEST(52,shrink1);
+    VIKTEST(53,large1);
+    VIKTEST(54,sizeclass1);
     
     if (test_number == 0) {
         fprintf(log_stream, "\n\nWoooooooHooooooo!!! "
@@ -1745,3 +1791,1323 @@ strdup1(int testno)
 
     fprintf(log_stream,"*** End %d\n", testno);
 }
+
+void
+hugepages1(int testno)
+{
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    vikalloc_stats_t stats;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      huge page backed heap\n");
+
+    if (vikalloc_set_huge_pages(TRUE)) {
+        ptr1 = vikalloc(100);
+        ptr2 = vikalloc(HUGE_PAGE_SIZE);
+        assert(ptr1 != NULL);
+        assert(ptr1 < ptr2);
+        // The region is huge page aligned, so the first block is too.
+        assert((((uintptr_t) ptr1) % HUGE_PAGE_SIZE) == sizeof(heap_block_t));
+
+        vikalloc_get_stats(&stats);
+        assert(stats.heap_bytes % HUGE_PAGE_SIZE == 0);
+        assert(stats.huge_page_bytes <= stats.heap_bytes);
+
+        vikfree(ptr1);
+        vikfree(ptr2);
+        vikalloc_reset();
+        vikalloc_get_stats(&stats);
+        assert(stats.heap_bytes == 0);
+
+        // Switching back is only allowed with an empty heap.
+        assert(vikalloc_set_huge_pages(FALSE) == FALSE);
+    }
+    // A huge page heap never moves the program break.
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+purge1(int testno)
+{
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    size_t chunk = 1024 * 1024;
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      purge interior free pages\n");
+
+    vikalloc_set_purge(PURGE_DONTNEED, 0);
+    ptr1 = vikalloc(chunk);
+    ptr2 = vikalloc(chunk);
+    ptr3 = vikalloc(chunk);
+    memset(ptr1, 1, chunk);
+    memset(ptr2, 2, chunk);
+    memset(ptr3, 3, chunk);
+
+    vikalloc_get_stats(&before);
+    vikfree(ptr2);
+    vikalloc_get_stats(&after);
+
+    // All but the first and last pages of the middle block go back.
+    assert(after.purged_bytes - before.purged_bytes >= chunk - (4 * 4096));
+    assert(after.rss_bytes < before.rss_bytes);
+    assert(after.live_bytes == before.live_bytes - chunk);
+
+    // The purged block is still usable.
+    ptr2 = vikalloc(chunk / 2);
+    memset(ptr2, 4, chunk / 2);
+    assert(((char *) ptr3)[0] == 3);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikalloc_set_purge(PURGE_NONE, 0);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+medium1(int testno)
+{
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    vikalloc_stats_t stats;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      medium objects in bitmap runs\n");
+
+    if (!vikalloc_set_medium(TRUE)) {
+        fprintf(log_stream,"  medium objects not available\n");
+        fprintf(log_stream,"*** End %d\n", testno);
+        return;
+    }
+    ptr1 = vikalloc(300);
+    ptr2 = vikalloc(300);
+    ptr3 = vikalloc(1000);
+    memset(ptr1, 1, 300);
+    memset(ptr2, 2, 300);
+    memset(ptr3, 3, 1000);
+
+    // Medium objects don't come from the heap, and 300 bytes rounds up
+    // to the 320 byte class.
+    assert(sbrk(0) == base);
+    assert(((char *) ptr2) - ((char *) ptr1) == 320);
+
+    // A freed slot is the next one handed out, and freeing it twice is
+    // caught by the bitmap.
+    vikfree(ptr1);
+    vikfree(ptr1);
+    assert(vikalloc(260) == ptr1);
+    assert(vikalloc(260) != ptr1);
+
+    // Growing past the slot moves the object.
+    ptr2 = vikrealloc(ptr2, 2000);
+    assert(((char *) ptr2)[299] == 2);
+
+    vikalloc_get_stats(&stats);
+    assert(stats.medium_bytes > 0);
+    assert(stats.live_bytes == 320 + 320 + 1024 + 2048);
+
+    vikalloc_reset();
+    vikalloc_get_stats(&stats);
+    assert(0 == stats.medium_bytes);
+    vikalloc_set_medium(FALSE);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+// Runs the same mix of calls with the free list in the blocks and in
+// the side table, and checks that everything lands in the same place.
+void
+sidetable1(int testno)
+{
+    void *ptrs[2][20] = {{NULL}};
+    size_t sizes[20] = {900, 100, 3000, 40, 700, 2000, 60, 5000, 300, 10
+                        , 1000, 200, 800, 90, 4000, 70, 500, 30, 2500, 150};
+    int pass = 0;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      free list in a side table\n");
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < 20; i++) {
+            ptrs[pass][i] = vikalloc(sizes[i]);
+        }
+        for (i = 0; i < 20; i += 3) {
+            vikfree(ptrs[pass][i]);
+        }
+        if (1 == pass && !vikalloc_set_side_table(TRUE)) {
+            fprintf(log_stream,"  side table not available\n");
+            vikalloc_reset();
+            fprintf(log_stream,"*** End %d\n", testno);
+            return;
+        }
+        for (i = 0; i < 20; i += 3) {
+            ptrs[pass][i] = vikalloc(sizes[19 - i]);
+        }
+        for (i = 1; i < 20; i += 4) {
+            ptrs[pass][i] = vikrealloc(ptrs[pass][i], sizes[i] / 2);
+            vikfree(ptrs[pass][i + 1]);
+        }
+        for (i = 1; i < 20; i += 4) {
+            ptrs[pass][i + 1] = vikalloc(sizes[i]);
+        }
+        vikalloc_reset();
+    }
+    vikalloc_set_side_table(FALSE);
+
+    for (i = 0; i < 20; i++) {
+        assert(ptrs[0][i] == ptrs[1][i]);
+    }
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+pool1(int testno)
+{
+    vikpool_t *pool = NULL;
+    void *ptrs[3000] = {NULL};
+    void *ptr1 = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      fixed size pool\n");
+
+    assert(vikpool_create(0, 8) == NULL && EINVAL == errno);
+    assert(vikpool_create(24, 12) == NULL && EINVAL == errno);
+
+    // 40 byte objects, 64 byte aligned, packed with no headers.
+    pool = vikpool_create(40, 64);
+    for (i = 0; i < 3000; i++) {
+        ptrs[i] = vikpool_alloc(pool);
+        assert(((uintptr_t) ptrs[i]) % 64 == 0);
+        memset(ptrs[i], i, 40);
+    }
+    assert(((char *) ptrs[1]) - ((char *) ptrs[0]) == 64);
+    assert(((unsigned char *) ptrs[1000])[39] == (1000 & 0xff));
+
+    // Freed objects are reused, last freed first.
+    vikpool_free(pool, ptrs[10]);
+    vikpool_free(pool, ptrs[20]);
+    vikpool_free(pool, NULL);
+    ptr1 = vikpool_alloc(pool);
+    assert(ptr1 == ptrs[20]);
+    ptr1 = vikpool_alloc(pool);
+
+    vikpool_destroy(pool);
+
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+heaps1(int testno)
+{
+    vikheap_options_t options;
+    vikheap_t *heap1 = NULL;
+    vikheap_t *heap2 = NULL;
+    vikalloc_stats_t stats;
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    void *ptr4 = NULL;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      independent heaps\n");
+
+    memset(&options, 0, sizeof(options));
+    options.fit_algorithm = NEXT_FIT;
+    options.min_sbrk_size = 8192;
+    options.reserve = 64 * 1024;
+    heap1 = vikheap_create(NULL);
+    heap2 = vikheap_create(&options);
+    assert(heap1 != NULL && heap2 != NULL);
+
+    ptr1 = vikheap_alloc(heap1, 100);
+    ptr2 = vikheap_alloc(heap1, 100);
+    ptr3 = vikheap_alloc(heap2, 100);
+    ptr4 = vikalloc(100);
+
+    // Each heap has its own memory, and neither of the new ones touches
+    // the program break.
+    assert(((char *) ptr2) - ((char *) ptr1) == 100 + (long) sizeof(heap_block_t));
+    assert(ptr1 != ptr3 && ptr3 != ptr4);
+    vikalloc_get_stats(&stats);
+    assert(sbrk(0) == ((char *) base) + stats.heap_bytes);
+
+    vikheap_get_stats(heap2, &stats);
+    assert(8192 == stats.heap_bytes);
+    assert(100 == stats.live_bytes);
+
+    // Freeing in one heap reuses space only in that heap.
+    vikheap_free(heap1, ptr1);
+    assert(vikheap_alloc(heap2, 50) != ptr1);
+    assert(vikheap_alloc(heap1, 50) == ptr1);
+    ptr3 = vikheap_realloc(heap2, ptr3, 200);
+    memset(ptr3, 1, 200);
+
+    // heap2 can't grow past what it reserved.
+    errno = 0;
+    assert(vikheap_alloc(heap2, 100 * 1024) == NULL);
+    assert(ENOMEM == errno);
+
+    vikheap_reset(heap1);
+    vikheap_get_stats(heap1, &stats);
+    assert(0 == stats.heap_bytes);
+    ptr1 = vikheap_alloc(heap1, 100);
+    assert(ptr1 != NULL);
+
+    vikheap_destroy(heap1);
+    vikheap_destroy(heap2);
+
+    vikfree(ptr4);
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+buffer1(int testno)
+{
+    static char buffer[16 * 1024];
+    vikheap_t *heap = NULL;
+    vikalloc_stats_t stats;
+    void *ptrs[100] = {NULL};
+    void *ptr1 = NULL;
+    int count = 0;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      heap in a caller's buffer\n");
+
+    assert(vikheap_init_from_buffer(buffer, 64) == NULL && EINVAL == errno);
+    heap = vikheap_init_from_buffer(buffer, sizeof(buffer));
+    assert(heap != NULL);
+
+    // Fill it up. Everything comes from the buffer, and running out is
+    // an ENOMEM rather than a trip to sbrk().
+    errno = 0;
+    for (count = 0; count < 100; count++) {
+        ptrs[count] = vikheap_alloc(heap, 500);
+        if (NULL == ptrs[count]) {
+            break;
+        }
+        assert(((char *) ptrs[count]) >= buffer
+               && ((char *) ptrs[count]) + 500 <= buffer + sizeof(buffer));
+        memset(ptrs[count], count, 500);
+    }
+    assert(count > 20 && count < 100);
+    assert(ENOMEM == errno);
+    assert(sbrk(0) == base);
+
+    // Freeing it all coalesces back to one free block.
+    for (i = 0; i < count; i += 2) {
+        vikheap_free(heap, ptrs[i]);
+    }
+    for (i = 1; i < count; i += 2) {
+        vikheap_free(heap, ptrs[i]);
+    }
+    vikheap_get_stats(heap, &stats);
+    assert(0 == stats.live_bytes);
+    ptr1 = vikheap_alloc(heap, 12 * 1024);
+    assert(ptr1 == ptrs[0]);
+
+    vikheap_reset(heap);
+    assert(vikheap_alloc(heap, 12 * 1024) == ptrs[0]);
+    vikheap_destroy(heap);
+
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+shared1(int testno)
+{
+    char name[64];
+    vikheap_t *heap = NULL;
+    vikalloc_stats_t stats;
+    char *str = NULL;
+    pid_t pid = 0;
+    int status = 0;
+    int fd = -1;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      heap shared between processes\n");
+
+    sprintf(name, "/vikalloc-%d", (int) getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0);
+    shm_unlink(name);
+
+    heap = vikheap_create_shared(fd, 64 * 1024, NULL);
+    assert(heap != NULL);
+    str = vikheap_alloc(heap, 100);
+    strcpy(str, "from the parent");
+    vikheap_set_root(heap, str);
+
+    // A segment that doesn't hold a heap is turned away. One can't be
+    // made where the first heap is, but a second one can go anywhere
+    // else.
+    {
+        vikheap_t *second = NULL;
+        int other = -1;
+
+        sprintf(name, "/vikalloc-%d-other", (int) getpid());
+        other = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        assert(other >= 0);
+        shm_unlink(name);
+        assert(ftruncate(other, 4096) == 0);
+        assert(vikheap_attach_shared(other) == NULL && EINVAL == errno);
+        assert(vikheap_create_shared(other, 4096, heap) == NULL && EEXIST == errno);
+        second = vikheap_create_shared(other, 4096, NULL);
+        assert(second != NULL && second != heap);
+        assert(vikheap_alloc(second, 100) != NULL);
+        vikheap_destroy(second);
+        close(other);
+    }
+
+    // The child drops the mapping it inherited and attaches the way an
+    // unrelated process would. It finds the string through the root and
+    // hands back one of its own.
+    pid = fork();
+    assert(pid >= 0);
+    if (0 == pid) {
+        vikheap_t *child = NULL;
+        char *reply = NULL;
+
+        vikheap_destroy(heap);
+        child = vikheap_attach_shared(fd);
+        if (child != heap || strcmp(vikheap_get_root(child), "from the parent") != 0) {
+            _exit(1);
+        }
+        reply = vikheap_alloc(child, 100);
+        if (NULL == reply) {
+            _exit(2);
+        }
+        strcpy(reply, "from the child");
+        vikheap_free(child, vikheap_get_root(child));
+        vikheap_set_root(child, reply);
+        vikheap_destroy(child);
+        _exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    // The child's changes are in the parent's heap.
+    str = vikheap_get_root(heap);
+    assert(strcmp(str, "from the child") == 0);
+    vikheap_get_stats(heap, &stats);
+    assert(100 == stats.live_bytes);
+
+    // While mapped here, nothing else can attach at the same address.
+    assert(vikheap_attach_shared(fd) == NULL && EEXIST == errno);
+
+    vikheap_destroy(heap);
+    close(fd);
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+file1(int testno)
+{
+    char path[] = "/tmp/vikalloc-XXXXXX";
+    vikheap_t *heap = NULL;
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    heap_block_t bad;
+    char *str = NULL;
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *addr = NULL;
+    void *block = NULL;
+    int fd = -1;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      heap kept in a file\n");
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    heap = vikheap_open_file(path, 64 * 1024);
+    assert(heap != NULL);
+    str = vikheap_alloc(heap, 100);
+    strcpy(str, "still here");
+    vikheap_set_root(heap, str);
+    ptr1 = vikheap_alloc(heap, 1000);
+    ptr2 = vikheap_alloc(heap, 500);
+    vikheap_free(heap, ptr1);
+    vikheap_get_stats(heap, &before);
+    assert(vikheap_sync(heap) == 0);
+    addr = heap;
+    vikheap_destroy(heap);
+
+    // Reopening puts everything back where it was, free list and all.
+    heap = vikheap_open_file(path, 0);
+    assert(heap == addr);
+    assert(strcmp(vikheap_get_root(heap), "still here") == 0);
+    vikheap_get_stats(heap, &after);
+    assert(before.live_bytes == after.live_bytes);
+    assert(before.heap_bytes == after.heap_bytes);
+    vikheap_dump(heap, NULL);
+    assert(vikheap_alloc(heap, 800) == ptr1);
+    vikheap_destroy(heap);
+
+    // With its address taken, the heap is moved and still works.
+    addr = mmap(addr, 4096, PROT_READ | PROT_WRITE
+                , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    assert(addr != MAP_FAILED);
+    heap = vikheap_open_file(path, 0);
+    assert(heap != NULL && (void *) heap != addr);
+    str = vikheap_get_root(heap);
+    assert(strcmp(str, "still here") == 0);
+    assert((char *) str > (char *) heap && (char *) str < (char *) heap + 64 * 1024);
+    vikheap_free(heap, str);
+    vikheap_get_stats(heap, &after);
+    assert(before.live_bytes - 100 + 800 == after.live_bytes);
+    ptr2 = vikheap_alloc(heap, 64 * 1024);
+    assert(NULL == ptr2);
+    vikheap_destroy(heap);
+    munmap(addr, 4096);
+
+    // A damaged block is caught when the file is opened.
+    heap = vikheap_open_file(path, 0);
+    assert(heap != NULL);
+    block = ((char *) vikheap_alloc(heap, 100)) - sizeof(heap_block_t);
+    memcpy(&bad, block, sizeof(bad));
+    bad.capacity += 16;
+    memcpy(block, &bad, sizeof(bad));
+    vikheap_destroy(heap);
+    errno = 0;
+    assert(vikheap_open_file(path, 0) == NULL && EINVAL == errno);
+
+    unlink(path);
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+checkpoint1(int testno)
+{
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    char *str = NULL;
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    void *top = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      checkpoint and rollback\n");
+
+    assert(vikalloc_rollback() == -1 && EINVAL == errno);
+    assert(vikalloc_commit() == -1 && EINVAL == errno);
+
+    str = vikstrdup("kept");
+    ptr1 = vikalloc(1000);
+    vikalloc_get_stats(&before);
+    top = sbrk(0);
+
+    // Everything done inside the checkpoint goes away, including the
+    // free of an older block, and the memory goes back to the kernel.
+    assert(vikalloc_checkpoint() == 0);
+    for (i = 0; i < 100; i++) {
+        memset(vikalloc(500), i, 500);
+    }
+    vikfree(str);
+    assert(vikrealloc(ptr1, 10) != ptr1);
+    assert(vikalloc_rollback() == 0);
+    assert(sbrk(0) == top);
+    assert(strcmp(str, "kept") == 0);
+    vikalloc_get_stats(&after);
+    assert(before.live_bytes == after.live_bytes);
+    assert(before.heap_bytes == after.heap_bytes);
+
+    // Checkpoints stack. Rolling back the inner one keeps the outer.
+    assert(vikalloc_checkpoint() == 0);
+    ptr2 = vikalloc(200);
+    top = sbrk(0);
+    assert(vikalloc_checkpoint() == 0);
+    memset(vikalloc(300), 3, 300);
+    assert(vikalloc_rollback() == 0);
+    assert(sbrk(0) == top);
+    ptr3 = vikalloc(300);
+    assert(ptr3 != NULL);
+
+    // Committing keeps the blocks and does the frees that were put off.
+    vikfree(str);
+    assert(vikalloc_commit() == 0);
+    vikalloc_get_stats(&after);
+    assert(before.live_bytes - 5 + 200 + 300 == after.live_bytes);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikfree(ptr1);
+    vikalloc_get_stats(&after);
+    assert(0 == after.live_bytes);
+    vikalloc_dump2(base);
+
+    // A free put off by a checkpoint goes back to the heap on commit,
+    // not into a cache.
+    vikalloc_set_cache_mode(CACHE_THREAD);
+    ptr1 = vikalloc(32);
+    vikalloc_get_stats(&before);
+    assert(vikalloc_checkpoint() == 0);
+    vikfree(ptr1);
+    assert(vikalloc_commit() == 0);
+    vikalloc_get_stats(&after);
+    assert(before.cache_bytes == after.cache_bytes);
+    assert(before.live_bytes - 32 == after.live_bytes);
+    vikalloc_set_cache_mode(CACHE_NONE);
+
+    // A reset drops any checkpoints still open.
+    assert(vikalloc_checkpoint() == 0);
+    assert(vikalloc_checkpoint() == 0);
+    vikalloc(100);
+    vikalloc_reset();
+    assert(vikalloc_rollback() == -1);
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+compact1(int testno)
+{
+    vikhandle_t *handles[NUM_PTRS] = {NULL};
+    vikalloc_stats_t stats;
+    void *pinned = NULL;
+    void *top = NULL;
+    char *str = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      handles and compaction\n");
+
+    pinned = vikalloc(100);
+    for (i = 0; i < NUM_PTRS; i++) {
+        handles[i] = vikalloc_handle(200);
+        sprintf(vikhandle_get(handles[i]), "handle %d", i);
+    }
+    top = sbrk(0);
+
+    // Free every other one, which leaves the heap full of holes.
+    for (i = 0; i < NUM_PTRS; i += 2) {
+        vikhandle_free(handles[i]);
+        handles[i] = NULL;
+    }
+
+    // A small budget needs more than one call for the whole pass.
+    i = 0;
+    while (!vikalloc_compact(1)) {
+        i++;
+    }
+    fprintf(log_stream,"      %d calls\n", i + 1);
+
+    // The objects have moved down next to each other, the block from
+    // vikalloc() hasn't, and the free space at the end is gone.
+    assert(((char *) sbrk(0)) < ((char *) top));
+    for (i = 1; i < NUM_PTRS; i += 2) {
+        char expect[32];
+
+        sprintf(expect, "handle %d", i);
+        str = vikhandle_get(handles[i]);
+        assert(strcmp(str, expect) == 0);
+        if (i > 1) {
+            assert((size_t) (str - (char *) vikhandle_get(handles[i - 2]))
+                   == 200 + sizeof(void *) + sizeof(heap_block_t));
+        }
+    }
+    assert((size_t) (((char *) vikhandle_get(handles[1])) - ((char *) pinned))
+           == ((heap_block_t *) pinned)[-1].capacity + sizeof(void *) + sizeof(heap_block_t));
+    vikalloc_get_stats(&stats);
+    assert(stats.heap_bytes == (size_t) ((char *) sbrk(0) - (char *) base));
+
+    for (i = 1; i < NUM_PTRS; i += 2) {
+        vikhandle_free(handles[i]);
+    }
+    vikfree(pinned);
+    assert(vikalloc_compact(0));
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+#define CACHE_THREADS 8
+
+static void *
+cache_worker(void *arg)
+{
+    void *ptrs[NUM_PTRS] = {NULL};
+    unsigned long seed = (unsigned long) arg;
+    int round = 0;
+    int i = 0;
+
+    for (round = 0; round < 200; round++) {
+        for (i = 0; i < NUM_PTRS; i++) {
+            size_t size = 0;
+
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            size = 1 + (seed >> 33) % 400;
+            ptrs[i] = vikalloc(size);
+            memset(ptrs[i], (int) (unsigned long) arg, size);
+        }
+        for (i = 0; i < NUM_PTRS; i++) {
+            assert(((unsigned char *) ptrs[i])[0] == (unsigned char) (unsigned long) arg);
+            vikfree(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+void
+cache1(int testno)
+{
+    vikalloc_cache_mode_t modes[] = {CACHE_THREAD, CACHE_CPU};
+    pthread_t threads[CACHE_THREADS];
+    vikalloc_stats_t stats;
+    vikalloc_latency_t lat;
+    FILE *stream = NULL;
+    char line[256];
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    int m = 0;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      thread and cpu caches\n");
+
+    for (m = 0; m < 2; m++) {
+        assert(vikalloc_set_cache_mode(modes[m]) == modes[m]);
+
+        // A freed small block is handed straight back out, and sizes
+        // that round up to the same class share it.
+        ptr1 = vikalloc(20);
+        vikfree(ptr1);
+        ptr2 = vikalloc(30);
+        assert(ptr1 == ptr2);
+        vikalloc_get_stats(&stats);
+        assert(stats.cache_bytes > 0);
+        vikfree(ptr2);
+
+        // Freeing a cached block again doesn't cache it twice, so it
+        // isn't handed out twice either.
+        vikfree(ptr2);
+        ptr1 = vikalloc(20);
+        ptr2 = vikalloc(20);
+        assert(ptr1 != ptr2);
+        vikfree(ptr1);
+        vikfree(ptr2);
+
+        for (i = 0; i < CACHE_THREADS; i++) {
+            assert(pthread_create(&threads[i], NULL, cache_worker
+                                  , (void *) (unsigned long) (i + 1)) == 0);
+        }
+        for (i = 0; i < CACHE_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    // Cached calls still show in the latency histograms and the
+    // profile, and a sample freed into a cache isn't live any more.
+    vikalloc_set_latency_tracking(TRUE);
+    vikalloc_set_sample_rate(1);
+    ptr1 = vikalloc(20);
+    vikfree(ptr1);
+    vikalloc_latency_get(&lat);
+    assert(1 == lat.count[VIK_PATH_CACHE] && 1 == lat.count[VIK_PATH_CACHE_FREE]);
+    stream = tmpfile();
+    assert(stream != NULL);
+    vikalloc_profile_dump(stream);
+    rewind(stream);
+    assert(fgets(line, sizeof(line), stream) != NULL);
+    assert(strstr(line, "1 samples (0 live)") != NULL);
+    fclose(stream);
+    vikalloc_set_sample_rate(0);
+    vikalloc_set_latency_tracking(FALSE);
+
+    // Turning the caches off gives everything back to the heap.
+    assert(vikalloc_set_cache_mode(CACHE_NONE) == CACHE_NONE);
+    vikalloc_get_stats(&stats);
+    assert(0 == stats.cache_bytes);
+    assert(0 == stats.live_bytes);
+    vikalloc_reset();
+    ptr1 = sbrk(0);
+    assert(ptr1 == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+#define TRANSFER_PTRS 256
+
+static void *transfer_ptrs[TRANSFER_PTRS];
+static pthread_barrier_t transfer_barrier;
+
+static void *
+transfer_freer(void *arg)
+{
+    int i = 0;
+
+    for (i = 0; i < TRANSFER_PTRS; i++) {
+        vikfree(transfer_ptrs[i]);
+    }
+    // Stay alive while the other thread looks, since an exiting thread
+    // flushes its cache.
+    pthread_barrier_wait(&transfer_barrier);
+    pthread_barrier_wait(&transfer_barrier);
+    return arg;
+}
+
+void
+transfer1(int testno)
+{
+    pthread_t thread;
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    void *top = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      transfer cache between threads\n");
+
+    vikalloc_set_cache_mode(CACHE_THREAD);
+    pthread_barrier_init(&transfer_barrier, NULL, 2);
+    for (i = 0; i < TRANSFER_PTRS; i++) {
+        transfer_ptrs[i] = vikalloc(32);
+    }
+
+    // The freeing thread keeps a few and hands the rest on in batches.
+    assert(pthread_create(&thread, NULL, transfer_freer, NULL) == 0);
+    pthread_barrier_wait(&transfer_barrier);
+    vikalloc_get_stats(&before);
+    assert(before.transfer_bytes >= (TRANSFER_PTRS - CACHE_CLASS_MAX) * 32);
+    assert(before.cache_bytes + before.transfer_bytes == TRANSFER_PTRS * 32);
+
+    // Allocating them again takes the batches without touching the heap.
+    top = sbrk(0);
+    for (i = 0; i < TRANSFER_PTRS - CACHE_CLASS_MAX; i++) {
+        transfer_ptrs[i] = vikalloc(32);
+    }
+    vikalloc_get_stats(&after);
+    assert(after.transfer_bytes < before.transfer_bytes);
+    assert(after.live_bytes == before.live_bytes);
+    assert(sbrk(0) == top);
+
+    pthread_barrier_wait(&transfer_barrier);
+    pthread_join(thread, NULL);
+    for (i = 0; i < TRANSFER_PTRS - CACHE_CLASS_MAX; i++) {
+        vikfree(transfer_ptrs[i]);
+    }
+    pthread_barrier_destroy(&transfer_barrier);
+    vikalloc_set_cache_mode(CACHE_NONE);
+    vikalloc_get_stats(&after);
+    assert(0 == after.transfer_bytes);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+// Waits up to 5 seconds for the maintenance thread to make the given
+// number of passes.
+static void
+maint_wait(size_t passes)
+{
+    vikalloc_stats_t stats;
+    size_t until = 0;
+    int tries = 0;
+
+    vikalloc_get_stats(&stats);
+    until = stats.maint_passes + passes;
+    for (tries = 0; tries < 5000 && stats.maint_passes < until; tries++) {
+        usleep(1000);
+        vikalloc_get_stats(&stats);
+    }
+    assert(stats.maint_passes >= until);
+}
+
+void
+maint1(int testno)
+{
+    void *ptrs[NUM_PTRS] = {NULL};
+    vikalloc_stats_t stats;
+    size_t frees = 0;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      background maintenance\n");
+
+    assert(vikalloc_set_maintenance(1, 1000) == 0);
+    for (i = 0; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc(1000);
+    }
+    for (i = 0; i < NUM_PTRS; i++) {
+        vikfree(ptrs[i]);
+    }
+
+    // The frees only queued the blocks. The thread does them, and then
+    // gives the empty heap back.
+    maint_wait(2);
+    vikalloc_get_stats(&stats);
+    assert(stats.maint_frees >= NUM_PTRS);
+    assert(stats.maint_trimmed_bytes > 0);
+    assert(0 == stats.live_bytes);
+    assert(sbrk(0) == base);
+
+    // A block freed twice while it waits is only queued once, and once
+    // the thread has freed it, another free finds it free. The block
+    // after it keeps it from being trimmed away.
+    frees = stats.maint_frees;
+    ptrs[0] = vikalloc(1000);
+    ptrs[1] = vikalloc(1000);
+    vikfree(ptrs[0]);
+    vikfree(ptrs[0]);
+    maint_wait(2);
+    vikfree(ptrs[0]);
+    vikalloc_get_stats(&stats);
+    assert(stats.maint_frees == frees + 1);
+    assert(1000 == stats.live_bytes);
+    vikfree(ptrs[1]);
+    maint_wait(2);
+    vikalloc_get_stats(&stats);
+    assert(0 == stats.live_bytes);
+
+    // A cache that goes unused is flushed back to the heap.
+    vikalloc_set_cache_mode(CACHE_THREAD);
+    vikfree(vikalloc(32));
+    vikalloc_get_stats(&stats);
+    assert(stats.cache_bytes > 0);
+    maint_wait(2);
+    vikalloc_get_stats(&stats);
+    assert(0 == stats.cache_bytes);
+    assert(stats.maint_flushed_bytes > 0);
+    fprintf(log_stream,"      %lu passes, %lu us\n"
+            , (unsigned long) stats.maint_passes, (unsigned long) stats.maint_busy_us);
+
+    // Stopping finishes whatever is still queued.
+    ptrs[0] = vikalloc(1000);
+    assert(vikalloc_set_maintenance(0, 0) == 0);
+    vikfree(ptrs[0]);
+    vikalloc_set_cache_mode(CACHE_NONE);
+    vikalloc_get_stats(&stats);
+    assert(0 == stats.live_bytes);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+hint1(int testno)
+{
+    void *ptrs[NUM_PTRS] = {NULL};
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    void *big1 = NULL;
+    void *big2 = NULL;
+    void *big3 = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      search hint for large misses\n");
+
+    for (i = 0; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc(100);
+    }
+    for (i = 0; i < NUM_PTRS; i += 2) {
+        vikfree(ptrs[i]);
+    }
+
+    // Once a large request has missed, the next one doesn't search.
+    big1 = vikalloc(100000);
+    vikalloc_get_stats(&before);
+    big2 = vikalloc(100000);
+    vikalloc_get_stats(&after);
+    assert(after.search_skips == before.search_skips + 1);
+
+    // Freeing a large block makes room again, and it gets used.
+    vikfree(big1);
+    big3 = vikalloc(100000);
+    assert(big3 == big1);
+    vikalloc_get_stats(&after);
+    assert(after.search_skips == before.search_skips + 1);
+    vikalloc_dump2(base);
+
+    vikfree(big2);
+    vikfree(big3);
+    for (i = 1; i < NUM_PTRS; i += 2) {
+        vikfree(ptrs[i]);
+    }
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+// Where first fit has to put a block of size bytes: walks the blocks
+// from the bottom of the heap for the first one with room.
+static void *
+lowest_fit(size_t size)
+{
+    heap_block_t *curr = (heap_block_t *) base;
+
+    for ( ; curr != NULL; curr = curr->next) {
+        if (curr->capacity - curr->size >= size + sizeof(heap_block_t)) {
+            if (0 == curr->size) {
+                return curr + 1;
+            }
+            return ((char *) (curr + 1)) + curr->size + sizeof(heap_block_t);
+        }
+    }
+    return NULL;
+}
+
+void
+firstfit1(int testno)
+{
+    void *ptrs[NUM_PTRS] = {NULL};
+    void *inner1 = NULL;
+    void *inner2 = NULL;
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    void *ptr4 = NULL;
+    void *expect = NULL;
+    int i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      first fit finds the lowest hole\n");
+
+    // With a LIFO list the list order is not the address order, but
+    // first fit still has to give the lowest block that fits.
+    vikalloc_set_free_list_order(FREE_LIST_LIFO);
+    vikalloc_set_algorithm(FIRST_FIT);
+    for (i = 0; i < NUM_PTRS; i++) {
+        ptrs[i] = vikalloc(100);
+    }
+    vikfree(ptrs[10]);
+    vikfree(ptrs[11]);
+    vikfree(ptrs[4]);
+    vikfree(ptrs[2]);
+
+    expect = lowest_fit(150);
+    ptr1 = vikalloc(150);
+    assert(ptr1 == expect);
+    expect = lowest_fit(20);
+    ptr2 = vikalloc(20);
+    assert(ptr2 == expect);
+
+    // The blocks from inside the checkpoint join the index on commit.
+    assert(vikalloc_checkpoint() == 0);
+    inner1 = vikalloc(100000);
+    inner2 = vikalloc(100);
+    vikfree(inner1);
+    assert(vikalloc_commit() == 0);
+    expect = lowest_fit(60);
+    ptr3 = vikalloc(60);
+    assert(ptr3 == expect);
+    expect = lowest_fit(50000);
+    ptr4 = vikalloc(50000);
+    assert(ptr4 == expect);
+    vikalloc_dump2(base);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikfree(ptr4);
+    vikfree(inner2);
+    for (i = 0; i < NUM_PTRS; i++) {
+        if (i != 2 && i != 4 && i != 10 && i != 11) {
+            vikfree(ptrs[i]);
+        }
+    }
+    vikalloc_set_algorithm(algo);
+    vikalloc_set_free_list_order(FREE_LIST_ADDRESS);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+stream1(int testno)
+{
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    size_t big = STREAM_MIN_SIZE + 1000037;
+    unsigned char *ptr1 = NULL;
+    unsigned char *ptr2 = NULL;
+    unsigned char *ptr3 = NULL;
+    size_t i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      streaming zero and copy of large buffers\n");
+
+    // Dirty the space first, so the zeroes have to be written.
+    ptr1 = vikalloc(big);
+    memset(ptr1, 0xa5, big);
+    vikfree(ptr1);
+    vikalloc_get_stats(&before);
+    ptr1 = vikcalloc(1, big);
+    for (i = 0; i < big; i++) {
+        assert(0 == ptr1[i]);
+    }
+
+    // Odd offsets, so the ends are copied apart from the middle.
+    ptr2 = vikalloc(big + 3);
+    for (i = 0; i < big + 3; i++) {
+        ptr2[i] = (unsigned char) (i * 7);
+    }
+    ptr2 = vikrealloc(ptr2, big * 2);
+    for (i = 0; i < big + 3; i++) {
+        assert((unsigned char) (i * 7) == ptr2[i]);
+    }
+    vikalloc_get_stats(&after);
+#ifdef __x86_64__
+    assert(after.streamed_bytes >= before.streamed_bytes + 2 * (big - 256));
+#endif
+
+    // Turned off, it is all memset() and memcpy().
+    vikalloc_set_stream_min(0);
+    ptr3 = vikcalloc(big, 1);
+    for (i = 0; i < big; i++) {
+        assert(0 == ptr3[i]);
+    }
+    vikalloc_get_stats(&before);
+    assert(after.streamed_bytes == before.streamed_bytes);
+    vikalloc_set_stream_min(STREAM_MIN_SIZE);
+    vikalloc_dump2(base);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+shrink1(int testno)
+{
+    heap_block_t *block = NULL;
+    size_t capacity = 0;
+    char *ptr1 = NULL;
+    char *ptr2 = NULL;
+    char *ptr3 = NULL;
+    char *ptr4 = NULL;
+    char *ptr5 = NULL;
+    char *ptr6 = NULL;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      shrinking realloc gives back the tail\n");
+
+    // The tail becomes a free block right after the 100 bytes kept.
+    ptr1 = vikalloc(100000);
+    memset(ptr1, 'a', 100000);
+    ptr2 = vikalloc(100);
+    assert(vikrealloc(ptr1, 100) == ptr1);
+    assert(((heap_block_t *) ptr1)[-1].capacity == 100);
+    block = (heap_block_t *) (ptr1 + 100);
+    assert(0 == block->size);
+    assert((char *) block->next == ptr2 - sizeof(heap_block_t));
+    assert('a' == ptr1[99]);
+
+    // And it gets used.
+    ptr3 = vikalloc(50000);
+    assert(ptr3 == (char *) (block + 1));
+
+    // It coalesces with a free block after it.
+    ptr4 = vikalloc(20000);
+    ptr5 = vikalloc(20000);
+    ptr6 = vikalloc(100);
+    vikfree(ptr5);
+    assert(vikrealloc(ptr4, 10) == ptr4);
+    block = (heap_block_t *) (ptr4 + 10);
+    assert(0 == block->size);
+    assert((char *) block->next == ptr6 - sizeof(heap_block_t));
+
+    // Small shrinks keep their capacity.
+    ptr5 = vikalloc(3000);
+    assert(vikrealloc(ptr5, 2000) == ptr5);
+    capacity = ((heap_block_t *) ptr5)[-1].capacity;
+    assert(vikrealloc(ptr5, 10) == ptr5);
+    assert(((heap_block_t *) ptr5)[-1].capacity == capacity);
+    vikalloc_dump2(base);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikfree(ptr3);
+    vikfree(ptr4);
+    vikfree(ptr5);
+    vikfree(ptr6);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+large1(int testno)
+{
+    vikalloc_stats_t before;
+    vikalloc_stats_t after;
+    size_t big = LARGE_MIN_SIZE;
+    char *ptr1 = NULL;
+    char *ptr2 = NULL;
+    char *ptr3 = NULL;
+    size_t i = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      large objects are remapped, not copied\n");
+
+    // A mapping of its own, so the heap doesn't grow.
+    vikalloc_get_stats(&before);
+    ptr1 = vikalloc(big);
+    assert(sbrk(0) == base);
+    vikalloc_get_stats(&after);
+    assert(after.large_bytes >= before.large_bytes + big);
+    ptr1[0] = 'a';
+    ptr1[big - 1] = 'z';
+
+    // Growing and shrinking keep the contents.
+    ptr1 = vikrealloc(ptr1, big * 4);
+    assert('a' == ptr1[0] && 'z' == ptr1[big - 1]);
+    ptr1[big * 4 - 1] = 'q';
+    ptr1 = vikrealloc(ptr1, big);
+    assert('a' == ptr1[0] && 'z' == ptr1[big - 1]);
+    vikalloc_get_stats(&before);
+    assert(before.large_remaps == after.large_remaps + 2);
+
+    // New pages are zero without being written.
+    ptr2 = vikcalloc(big, 1);
+    for (i = 0; i < big; i += 512) {
+        assert(0 == ptr2[i]);
+    }
+
+    // Shrunk a long way, it moves into the heap.
+    ptr1 = vikrealloc(ptr1, 100);
+    assert('a' == ptr1[0]);
+    assert(sbrk(0) != base);
+
+    // One from before a checkpoint comes back on rollback, and one made
+    // inside it is in the heap.
+    assert(vikalloc_checkpoint() == 0);
+    vikfree(ptr2);
+    vikalloc_get_stats(&before);
+    ptr3 = vikalloc(big);
+    vikalloc_get_stats(&after);
+    assert(after.large_bytes == before.large_bytes);
+    assert(ptr3 != NULL && (void *) ptr3 < sbrk(0));
+    assert(vikalloc_rollback() == 0);
+    ptr2[big - 1] = 'x';
+    vikalloc_dump2(base);
+
+    vikfree(ptr1);
+    vikfree(ptr2);
+    vikalloc_reset();
+    vikalloc_get_stats(&after);
+    assert(0 == after.large_bytes);
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
+
+void
+sizeclass1(int testno)
+{
+    FILE *stream = NULL;
+    char line[128];
+    void *ptr1 = NULL;
+    void *ptr2 = NULL;
+    void *ptr3 = NULL;
+    void *ptr4 = NULL;
+    void *ptr5 = NULL;
+    int found = 0;
+
+    fprintf(log_stream,"*** Begin %d\n", testno);
+    fprintf(log_stream,"      size histogram and size class tables\n");
+
+    // Requests are counted by size, rounded up to 16 bytes, whichever
+    // way they go.
+    vikalloc_set_size_histogram(TRUE);
+    ptr1 = vikalloc(20);
+    ptr2 = vikalloc(30);
+    ptr3 = vikalloc(300);
+    ptr4 = vikalloc(300);
+    ptr5 = vikalloc(100000);
+    vikalloc_set_size_histogram(FALSE);
+    assert(vikalloc(20) != NULL);
+
+    stream = tmpfile();
+    assert(stream != NULL);
+    vikalloc_size_histogram_dump(stream);
+    rewind(stream);
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        if (strcmp(line, "32 2\n") == 0 || strcmp(line, "304 2\n") == 0) {
+            found++;
+        }
+        else if (strstr(line, "# 5 requests, 1 over") == line) {
+            found++;
+        }
+        else {
+            assert('#' == line[0]);
+        }
+    }
+    fclose(stream);
+    assert(3 == found);
+
+    // The medium engine rounds up through the table, to the 320 byte
+    // class.
+    vikfree(ptr3);
+    vikfree(ptr4);
+    if (vikalloc_set_medium(TRUE)) {
+        ptr3 = vikalloc(300);
+        ptr4 = vikalloc(300);
+        assert(((char *) ptr4) - ((char *) ptr3) == 320);
+        vikfree(ptr3);
+        vikfree(ptr4);
+        vikalloc_set_medium(FALSE);
+    }
+
+    // So do the caches: 20 and 30 bytes share the 32 byte class.
+    vikfree(ptr1);
+    vikfree(ptr2);
+    assert(vikalloc_set_cache_mode(CACHE_THREAD) == CACHE_THREAD);
+    ptr1 = vikalloc(20);
+    vikfree(ptr1);
+    assert(vikalloc(30) == ptr1);
+    assert(vikalloc_set_cache_mode(CACHE_NONE) == CACHE_NONE);
+
+    vikfree(ptr5);
+    vikalloc_reset();
+    assert(sbrk(0) == base);
+
+    fprintf(log_stream,"*** End %d\n", testno);
+}
@@ -2,6 +2,24 @@
 // relia@pdx.edu
 
 #include "vikalloc.h"
+#include "vikalloc_size_classes.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+# if __has_include(<sys/rseq.h>)
+#  include <sys/rseq.h>
+#  define HAVE_RSEQ
+# endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
 
 // Returns the size of the structure, in bytes.
 #define BLOCK_SIZE (sizeof(heap_block_t))
@@ -12,49 +30,450 @@
 // Returns a pointer to the structure containing the data
 #define DATA_BLOCK(__curr) (((void *) __curr) - (BLOCK_SIZE))
 
+// A block freed into a cache, or queued while the maintenance thread
+// runs, has BLOCK_PARKED set in its size, which tells a second free of
+// it from the first. The bit is set without the heap lock and never
+// changes what the size means, so a size another thread might be
+// marking is read with CURR_SIZE(), which leaves the bit out.
+#define BLOCK_PARKED ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+#define CURR_SIZE(__curr) (__atomic_load_n(&(__curr)->size, __ATOMIC_RELAXED) & ~BLOCK_PARKED)
+#define IS_PARKED(__curr) ((__atomic_load_n(&(__curr)->size, __ATOMIC_RELAXED) & BLOCK_PARKED) != 0)
+
 // Returns 0 (false) if the block is NOT free, else 1 (true).
-#define IS_FREE(__curr) ((__curr -> size) == 0)
+#define IS_FREE(__curr) (CURR_SIZE(__curr) == 0)
 
 // A nice macro for formatting pointer values.
 #define PTR "0x%07lx"
 #define PTR_T PTR "\t" // just a tab
 
-#define CURR_EXCESS_CAPACITY(__curr) (__curr->capacity - __curr->size)
+#define CURR_EXCESS_CAPACITY(__curr) (__curr->capacity - CURR_SIZE(__curr))
+
+// Returns 1 (true) if the block has enough excess capacity that some
+// request could be placed in it, which is what puts it on the free list.
+#define IS_AVAIL(__curr) (CURR_EXCESS_CAPACITY(__curr) > BLOCK_SIZE)
+
+// The free list links live in the last bytes of a block's capacity.
+// They are only valid while IS_AVAIL() is true for the block, and
+// IS_AVAIL() guarantees they cannot overlap the user's data.
+typedef struct free_links_s {
+    heap_block_t *prev_free;
+    heap_block_t *next_free;
+    size_t next_capacity; // of next_free, so its links can be found without its header
+} free_links_t;
+
+// With the side table on (see vikalloc_set_side_table()), the links of
+// a free block live in a side table entry instead, next to a copy of
+// the block's excess capacity. Searching the free list then only reads
+// the table, which is dense, and not one cache line per free block.
+typedef struct side_entry_s {
+    free_links_t links;
+    heap_block_t *block;
+    size_t excess;                   // CURR_EXCESS_CAPACITY() of the block
+    struct side_entry_s *next_entry; // the entry of links.next_free
+} side_entry_t;
+
+// The first fit index, kept while the fit algorithm is FIRST_FIT: a
+// treap of the blocks on the free list, ordered by address, where every
+// node also knows the largest excess capacity in its subtree. Finding
+// the lowest block with room is one walk down the tree. The nodes come
+// from a reserved slab, like side table entries.
+typedef struct treap_node_s {
+    heap_block_t *block;
+    size_t excess;     // CURR_EXCESS_CAPACITY() of the block
+    size_t max_excess; // the largest excess in this subtree
+    uint32_t priority;
+    struct treap_node_s *left;  // lower addresses, or the next free node
+    struct treap_node_s *right; // higher addresses
+} treap_node_t;
+
+// Returns a pointer to the space at the end of a free block that holds
+// its links, or a pointer to its side table entry.
+#define FREE_TAIL(__curr) ((void *) (BLOCK_DATA(__curr) \
+	    + (__curr)->capacity - sizeof(free_links_t)))
+
+// Returns the side table entry of a free block.
+#define SIDE_ENTRY(__curr) (*(side_entry_t **) FREE_TAIL(__curr))
+
+// Returns a pointer to the free list links of a block.
+#define FREE_LINKS(__curr) (cur_heap->use_side_table ? &SIDE_ENTRY(__curr)->links \
+			    : (free_links_t *) FREE_TAIL(__curr))
+
+// While purging is enabled, the first bytes of every free block record
+// when it was freed and whether its pages have been handed back yet.
+// Blocks on the free list always have room for this and FREE_LINKS().
+typedef struct free_stamp_s {
+    uint64_t freed_ms;
+    uint64_t purged;
+} free_stamp_t;
+
+// Returns a pointer to the purge record of a free block.
+#define FREE_STAMP(__curr) ((free_stamp_t *) BLOCK_DATA(__curr))
+
+// Medium objects, from MEDIUM_MIN_SIZE to MEDIUM_MAX_SIZE bytes, don't
+// live in the block list. They are slots in runs of MEDIUM_RUN_SIZE
+// bytes carved from their own arena, one size class per run. Which
+// slots are free is kept in a bitmap in the run's descriptor, and the
+// descriptors are in a table of their own, so allocating or freeing a
+// medium object never touches the memory next to it.
+#define MEDIUM_BITMAP_WORDS ((MEDIUM_RUN_SIZE / MEDIUM_MIN_SIZE + 63) / 64)
+
+typedef struct medium_run_s {
+    struct medium_run_s *next; // on the partial list of its class, or the empty list
+    struct medium_run_s *prev;
+    uint32_t slot_size;        // 0 while the run holds no size class
+    uint16_t nslots;
+    uint16_t nfree;
+    uint64_t bitmap[MEDIUM_BITMAP_WORDS]; // a set bit is a free slot
+} medium_run_t;
+
+// Returns 1 (true) if the pointer came from the medium arena.
+#define MEDIUM_OWNS(__ptr) (((void *) (__ptr)) >= medium_base \
+			    && ((void *) (__ptr)) < medium_brk)
+
+// Large objects, of large_min_size bytes or more, get a mapping of
+// their own, so vikrealloc() can resize them with mremap() instead of
+// copying. The mapping starts with a large_block_t, which keeps it on
+// large_head, followed by a block header whose next points at itself,
+// which no block on a block list ever does.
+typedef struct large_block_s {
+    struct large_block_s *prev;
+    struct large_block_s *next;
+    size_t map_bytes;
+    size_t unused; // puts the object on a cache line boundary
+} large_block_t;
+
+#define LARGE_HEADER (sizeof(large_block_t) + BLOCK_SIZE)
+
+// Returns 1 (true) if the pointer, which must not be from the medium
+// arena, is a large object.
+#define LARGE_OWNS(__ptr) (((heap_block_t *) DATA_BLOCK(__ptr))->next \
+			   == (heap_block_t *) DATA_BLOCK(__ptr))
 
 // Function prototypes
 // Recursive function that combines adjacent free blocks
 void coalesce_up(heap_block_t * ptr);
 
-// Some variables that repesent (internally) global pointers to the
-// list in the heap.
-static heap_block_t *block_list_head = NULL;
-static heap_block_t *block_list_tail = NULL;
-static void *low_water_mark = NULL;
-static void *high_water_mark = NULL;
-
-// only used in next-fit algorithm
-// *************************************************************
-// *************************************************************
-// This is the variable you'll use to keep track of where the
-// next_fit algorithm left off when searching through the linked
-// list of heap_block_t sturctures.
-// *************************************************************
-// *************************************************************
-static heap_block_t *next_fit = NULL;
-
-static uint8_t isVerbose = FALSE;
-static vikalloc_fit_algorithm_t fit_algorithm = NEXT_FIT;
+// Everything about one heap. The vikalloc() family works on the default
+// heap, and the vikheap_*() functions point cur_heap at another heap for
+// the length of the call.
+struct vikheap_s {
+    // Some variables that repesent (internally) global pointers to the
+    // list in the heap.
+    heap_block_t *block_list_head;
+    heap_block_t *block_list_tail;
+    void *low_water_mark;
+    void *high_water_mark;
+
+    // only used in next-fit algorithm
+    // *************************************************************
+    // *************************************************************
+    // This is the variable you'll use to keep track of where the
+    // next_fit algorithm left off when searching through the linked
+    // list of heap_block_t sturctures.
+    // *************************************************************
+    // *************************************************************
+    heap_block_t *next_fit;
+
+    // The free list only holds the blocks that vikalloc() could place a
+    // request in (see IS_AVAIL()), so searching it costs the number of
+    // free blocks instead of the number of blocks in the heap.
+    // free_list_rover is where the next search starts. With address
+    // ordering it is the first block on the list at or after next_fit,
+    // which makes the search visit candidates in the same order as
+    // walking every block. A NULL rover means start over at the head.
+    heap_block_t *free_list_head;
+    heap_block_t *free_list_tail;
+    heap_block_t *free_list_rover;
+    vikalloc_free_list_order_t free_list_order;
+    // Nothing on the free list has miss_bound bytes of excess capacity
+    // or more, so a request that needs that much can't fit without a
+    // search. It is set from the largest excess seen by a search that
+    // went all the way around, and raised when a block goes on the
+    // list with more. 0 means nothing is known.
+    size_t miss_bound;
+    size_t search_skips;
+
+    // See treap_node_t. The slab is reserved the first time first fit is
+    // used, and is private to the process, so shared heaps do without.
+    // treap_full is set once the slab has run out, which keeps the heap
+    // on the plain free list until the algorithm changes.
+    uint8_t use_treap;
+    uint8_t treap_full;
+    treap_node_t *treap_slab;
+    size_t treap_used;
+    treap_node_t *treap_free;
+    treap_node_t *treap_root;
+
+    // The side table is reserved the first time it is turned on.
+    // Entries are handed out from the bottom and reused from
+    // side_table_free, so the ones in use stay packed together.
+    uint8_t use_side_table;
+    side_entry_t *side_table;
+    size_t side_table_used;
+    side_entry_t *side_table_free;
+    side_entry_t *side_head; // the entry of free_list_head
+
+    uint8_t isVerbose;
+    vikalloc_fit_algorithm_t fit_algorithm;
+
+    // This is the variable that hols the smallist amount of memory
+    // you should use when calling sbrk().
+    // When you call sbrk(), you must call with a multiple of this
+    // variable. The value of min_sbrk_size can be changed with a
+    // call to vikalloc_set_min().
+    size_t min_sbrk_size;
+
+    // Where the heap gets its memory. The default heap grows with sbrk().
+    // With huge pages enabled, and for every other heap, it grows
+    // through a HUGE_PAGE_SIZE aligned region of address space reserved
+    // with mmap(), committed from region_base up to region_brk. With
+    // huge pages, that is done a whole number of huge pages at a time, so
+    // the region can always be backed by huge pages.
+    uint8_t use_region;
+    uint8_t use_huge_pages;
+    void *region_base;
+    void *region_brk;
+    void *region_end;
+    void *map_base; // where the mapping of a vikheap_create() heap starts
+    uint8_t fixed;  // the region is a caller's buffer, and never grows
+
+    // A heap made by vikheap_create_shared() lives in a segment mapped at
+    // map_base in every process using it. magic tells
+    // vikheap_attach_shared() that a segment holds one, and lock keeps
+    // the processes from changing it at the same time.
+    uint64_t magic;
+    uint8_t shared;
+    pthread_mutex_t lock;
+    void *root; // see vikheap_set_root()
+
+    uint8_t persistent; // the segment is a file, see vikheap_open_file()
+
+    // The innermost open checkpoint, see vikalloc_checkpoint().
+    struct checkpoint_s *checkpoint;
+
+    // The handle table is reserved the first time a handle is made, and
+    // is used like the side table. compact_cursor is where an unfinished
+    // vikalloc_compact() pass picks up again.
+    vikhandle_t *handle_table;
+    size_t handles_used;
+    vikhandle_t *handle_free;
+    heap_block_t *compact_cursor;
+};
+
+// A checkpoint starts a new, empty heap at the top of the old one, and
+// keeps a copy of the old heap's vikheap_t in the first block of the new
+// one. None of the old blocks are touched until the checkpoint is
+// committed: frees of them are put off, on a list of deferred_free_t
+// blocks that is also in the new heap. Rolling back just puts the copy
+// back and lowers the break, which drops the whole new heap at once.
+typedef struct deferred_free_s {
+    void *ptr;
+    struct deferred_free_s *next;
+} deferred_free_t;
+
+typedef struct checkpoint_s {
+    vikheap_t saved;
+    deferred_free_t *deferred;
+} checkpoint_t;
+
+// TRUE if __ptr was allocated before the innermost checkpoint was taken.
+// Medium objects count as older too, since they aren't in the heap.
+#define CHECKPOINT_OLDER(__ptr) (cur_heap->checkpoint != NULL && (__ptr) != NULL \
+				 && ((void *) (__ptr) < cur_heap->low_water_mark \
+				     || (void *) (__ptr) >= cur_heap->high_water_mark))
+
+static vikheap_t default_heap = {
+    .free_list_order = FREE_LIST_ADDRESS,
+    .fit_algorithm = NEXT_FIT,
+    .min_sbrk_size = MIN_SBRK_SIZE,
+};
+static vikheap_t *cur_heap = &default_heap;
+
+// "vikheap" in ASCII, mixed with the size of vikheap_t so that a build
+// with a different layout won't attach to the heap.
+#define VIKHEAP_MAGIC (0x76696b68656170UL ^ sizeof(vikheap_t))
+
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE 0
+#endif // MAP_FIXED_NOREPLACE
+
+#ifndef MREMAP_MAYMOVE
+# define MREMAP_MAYMOVE 1
+#endif // MREMAP_MAYMOVE
+
+// Prefetch the next free block (or entry) while the search looks at
+// the current one.
+static uint8_t use_prefetch = FALSE;
+
+// Skip searches that miss_bound says can't succeed.
+static uint8_t use_search_hint = TRUE;
+
+// vikcalloc() and vikrealloc() zero or copy at least this many bytes
+// with non-temporal stores, or never if it is 0. See stream_zero().
+static size_t stream_min_size = STREAM_MIN_SIZE;
+static size_t streamed_bytes = 0;
+
+// Raises miss_bound for a block that has just gone on the free list, or
+// whose excess capacity has grown while on it.
+#define MISS_BOUND_RAISE(__curr) \
+    if (cur_heap->miss_bound != 0 && CURR_EXCESS_CAPACITY(__curr) >= cur_heap->miss_bound) { \
+	cur_heap->miss_bound = CURR_EXCESS_CAPACITY(__curr) + 1; \
+    }
+
+// Only taken once another thread can get at the heap, which is when the
+// caches or the maintenance thread are on. It is recursive, since
+// vikrealloc() holds it around its own calls to vikalloc() and vikfree().
+static pthread_mutex_t heap_lock;
+static uint8_t heap_lock_ready = FALSE;
+static uint8_t heap_locking = FALSE;
+
+static void heap_lock_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    if (!heap_lock_ready) {
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&heap_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	heap_lock_ready = TRUE;
+    }
+}
+
+// Takes heap_lock if other threads can get at the heap. Returns whether
+// it was taken, for heap_lock_drop().
+static uint8_t heap_lock_take(void)
+{
+    if (!__atomic_load_n(&heap_locking, __ATOMIC_RELAXED)) {
+	return FALSE;
+    }
+    pthread_mutex_lock(&heap_lock);
+    return TRUE;
+}
+
+static void heap_lock_drop(uint8_t locked)
+{
+    if (locked) {
+	pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+
+// The build variants in vikalloc.h can fix these at compile time, which
+// lets the compiler drop the checks from vikalloc() and vikfree().
+#ifdef VIKALLOC_QUIET
+# define IS_VERBOSE FALSE
+#else
+# define IS_VERBOSE cur_heap->isVerbose
+#endif // VIKALLOC_QUIET
+
+#ifdef VIKALLOC_FIXED_FIT
+# define FIT_ALGORITHM VIKALLOC_FIXED_FIT
+#else
+# define FIT_ALGORITHM cur_heap->fit_algorithm
+#endif // VIKALLOC_FIXED_FIT
+
+#ifdef VIKALLOC_FIXED_FREE_LIST
+# define FREE_LIST_ORDER VIKALLOC_FIXED_FREE_LIST
+#else
+# define FREE_LIST_ORDER cur_heap->free_list_order
+#endif // VIKALLOC_FIXED_FREE_LIST
 static FILE *vikalloc_log_stream = NULL;
 
 // Some gcc magic to initialize the diagnostic stream at startup.
 static void init_streams(void) __attribute__((constructor));
 
-// This is the variable that hols the smallist amount of memory
-// you should use when calling sbrk().
-// When you call sbrk(), you must call with a multiple of this
-// variable. The value of min_sbrk_size can be changed with a
-// call to vikalloc_set_min().
-static size_t min_sbrk_size = MIN_SBRK_SIZE;
+// Set once MAP_HUGETLB has failed, so it isn't tried again.
+static uint8_t hugetlb_failed = FALSE;
+
+// Purging hands the whole pages inside large free blocks back to the
+// kernel with madvise(). A block is purged once it has been free for
+// purge_decay_ms, so a block that is freed and reused right away does
+// not fault its pages back in every time.
+static vikalloc_purge_advice_t purge_advice = PURGE_NONE;
+static uint64_t purge_decay_ms = 0;
+static uint64_t purge_last_ms = 0;
+static size_t purged_bytes = 0;
+static size_t page_size = 0;
+
+// The maintenance thread, and what it has done. While it runs, vikfree()
+// only puts blocks from the default heap on maint_pending, and the
+// thread does the coalescing (see maint_defer()).
+static uint8_t maint_running = FALSE;
+static void *maint_pending = NULL;
+static unsigned maint_pending_count = 0;
+static size_t maint_passes = 0;
+static size_t maint_frees = 0;
+static size_t maint_trimmed_bytes = 0;
+static size_t maint_flushed_bytes = 0;
+static uint64_t maint_busy_us = 0;
+
+// The sampling profiler. Every sample_rate bytes allocated (on average),
+// vikalloc() records the size and a backtrace in a ring of
+// PROFILE_RING_SIZE samples. profile_index maps the pointers of live
+// samples to their slot in the ring, so vikfree() can mark them freed.
+// With sampling off, the only cost is one check in vikalloc().
+typedef struct profile_sample_s {
+    void *ptr;
+    size_t size;
+    uint64_t when_ms;
+    uint8_t live;
+    int depth;
+    void *frames[PROFILE_DEPTH];
+} profile_sample_t;
+
+// profile_index is probed with a mask, so its size has to be a power of
+// two.
+#define PROFILE_INDEX_SIZE (2 * PROFILE_RING_SIZE)
+_Static_assert((PROFILE_RING_SIZE & (PROFILE_RING_SIZE - 1)) == 0
+	       , "PROFILE_RING_SIZE must be a power of two");
+
+static size_t sample_rate = 0;
+static long sample_countdown = 0;
+static uint64_t sample_random = 88172645463325252ULL;
+static uint64_t profile_start_ms = 0;
+static size_t profile_next = 0;
+static size_t profile_count = 0;
+// Changed under the heap lock, but read without it by vikfree() on the
+// cache path, so it is only touched with atomics.
+static size_t profile_live = 0;
+static profile_sample_t profile_ring[PROFILE_RING_SIZE];
+static uint32_t profile_index[PROFILE_INDEX_SIZE];
+
+// The medium object arena. It is reserved the first time medium
+// objects are turned on and committed one run at a time.
+static uint8_t use_medium = FALSE;
+static void *medium_base = NULL;
+static void *medium_brk = NULL;
+static void *medium_end = NULL;
+static medium_run_t *medium_runs = NULL;
+static medium_run_t *medium_partial[MEDIUM_CLASSES];
+static medium_run_t *medium_empty = NULL;
+static size_t medium_in_use = 0;
+
+// The large objects (see large_block_t). 0 turns them off.
+static size_t large_min_size = LARGE_MIN_SIZE;
+static large_block_t *large_head = NULL;
+static size_t large_mapped = 0;
+static size_t large_in_use = 0;
+static size_t large_remaps = 0;
+
+// Latency tracking. The public entry points time each call and add it
+// to a log2 histogram for the path the call took, which the internal
+// functions leave in last_path. Ticks are TSC cycles on x86 and
+// nanoseconds everywhere else.
+static uint8_t latency_tracking = FALSE;
+static vikalloc_path_t last_path = VIK_PATH_FREE;
+static vikalloc_latency_t latency;
+
+// The size histogram, for vikalloc_tune. Requests are counted in
+// buckets of SIZE_HISTOGRAM_GRANULE bytes, which divides the granules
+// of both the caches and the medium engine, and everything past
+// MEDIUM_MAX_SIZE goes in the last bucket.
+#define SIZE_HISTOGRAM_GRANULE 16
+#define SIZE_HISTOGRAM_BUCKETS (MEDIUM_MAX_SIZE / SIZE_HISTOGRAM_GRANULE + 2)
+static uint8_t size_histogram_on = FALSE;
+static size_t size_histogram[SIZE_HISTOGRAM_BUCKETS];
 
 // This allows all diagnostic messages to go to a file.
 static void init_streams(void)
@@ -68,22 +487,28 @@ size_t vikalloc_set_min(size_t size)
     // Don't change this.
     if (0 == size) {
 	// just return the current value
-	return min_sbrk_size;
+	return cur_heap->min_sbrk_size;
     }
     if (size < (BLOCK_SIZE + BLOCK_SIZE)) {
 	// In the event that it is set to something silly small.
 	size = MAX(BLOCK_SIZE + BLOCK_SIZE, SILLY_SBRK_SIZE);
     }
-    min_sbrk_size = size;
+    cur_heap->min_sbrk_size = size;
 
-    return min_sbrk_size;
+    return cur_heap->min_sbrk_size;
 }
 
 void vikalloc_set_algorithm(vikalloc_fit_algorithm_t algorithm)
 {
     // Don't change this.
-    fit_algorithm = algorithm;
-    if (isVerbose) {
+    cur_heap->fit_algorithm = algorithm;
+    // The first fit index is built the next time it is needed. Blocks
+    // from before a checkpoint are in it, so it stays until then.
+    if (algorithm != FIRST_FIT && NULL == cur_heap->checkpoint) {
+	cur_heap->use_treap = FALSE;
+	cur_heap->treap_full = FALSE;
+    }
+    if (IS_VERBOSE) {
 	switch (algorithm) {
 	    case FIRST_FIT:
 		fprintf(vikalloc_log_stream, "** First fit selected\n");
@@ -100,7 +525,7 @@ void vikalloc_set_algorithm(vikalloc_fit_algorithm_t algorithm)
 	    default:
 		fprintf(vikalloc_log_stream, "** Algorithm not recognized %d\n"
 			, algorithm);
-		fit_algorithm = FIRST_FIT;
+		cur_heap->fit_algorithm = FIRST_FIT;
 		break;
 	}
     }
@@ -109,8 +534,8 @@ void vikalloc_set_algorithm(vikalloc_fit_algorithm_t algorithm)
 void vikalloc_set_verbose(uint8_t verbosity)
 {
     // Don't change this.
-    isVerbose = verbosity;
-    if (isVerbose) {
+    cur_heap->isVerbose = verbosity;
+    if (IS_VERBOSE) {
 	fprintf(vikalloc_log_stream, "Verbose enabled\n");
     }
 }
@@ -121,266 +546,4187 @@ void vikalloc_set_log(FILE *stream)
     vikalloc_log_stream = stream;
 }
 
-void * vikalloc(size_t size)
+// Reserves bytes of address space for a heap, aligned to
+// HUGE_PAGE_SIZE. Nothing in it is usable until it is committed.
+// Returns NULL if the address space isn't available.
+static void *region_reserve(size_t bytes)
 {
-    heap_block_t * curr = next_fit;
-    size_t size_to_request = 0;
-    void * data_block = NULL;
-    heap_block_t * new_heap_node = NULL;
-    if (isVerbose) {
-	fprintf(vikalloc_log_stream, ">> %d: %s entry: size = %lu\n"
-		, __LINE__, __FUNCTION__, size);
-    }
-
+    void *raw = NULL;
+    uintptr_t aligned = 0;
 
-    if (0 == size) {
+    raw = mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_NONE
+	       , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == raw) {
 	return NULL;
     }
+    aligned = ((uintptr_t) raw + HUGE_PAGE_SIZE - 1)
+	& ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+    // Give back the slop on either side of the aligned region.
+    if (aligned > (uintptr_t) raw) {
+	munmap(raw, aligned - (uintptr_t) raw);
+    }
+    munmap((void *) (aligned + bytes)
+	   , (uintptr_t) raw + HUGE_PAGE_SIZE - aligned);
+    return (void *) aligned;
+}
+
+// Commits the next bytes of the reserved region. With huge pages, bytes
+// must be a multiple of HUGE_PAGE_SIZE. Like sbrk(), returns (void *) -1
+// on failure.
+static void *region_more(size_t bytes)
+{
+    void *start = cur_heap->region_brk;
 
-    if(low_water_mark == NULL) {
-	low_water_mark = sbrk(0);
+    if (bytes > (size_t) (cur_heap->region_end - cur_heap->region_brk)) {
+	return (void *) -1;
+    }
+# ifdef MAP_HUGETLB
+    if (cur_heap->use_huge_pages && !hugetlb_failed) {
+	if (mmap(start, bytes, PROT_READ | PROT_WRITE
+		 , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB
+		 , -1, 0) != MAP_FAILED) {
+	    cur_heap->region_brk += bytes;
+	    return start;
+	}
+	// No huge pages have been set aside on this host. Don't keep asking.
+	hugetlb_failed = TRUE;
+    }
+# endif // MAP_HUGETLB
+    // A failed MAP_FIXED mapping may have unmapped the range, so map it
+    // again rather than just changing the protection.
+    if (mmap(start, bytes, PROT_READ | PROT_WRITE
+	     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE
+	     , -1, 0) == MAP_FAILED) {
+	return (void *) -1;
     }
+# ifdef MADV_HUGEPAGE
+    // Without transparent huge pages this fails, and the region is just
+    // backed by normal pages.
+    if (cur_heap->use_huge_pages) {
+	madvise(start, bytes, MADV_HUGEPAGE);
+    }
+# endif // MADV_HUGEPAGE
+    cur_heap->region_brk += bytes;
+    return start;
+}
 
-    // There will always be at least 1 block requested
-    // Here we take advantage of integer division to determine the number
-    // of additional blocks needed
-    size_to_request = ((size + BLOCK_SIZE) / min_sbrk_size);
-    if((size + BLOCK_SIZE) % min_sbrk_size != 0) {
-	size_to_request++;
+// Hands everything committed in the region back to the kernel.
+// A heap in a caller's buffer just starts over.
+static void region_release(void)
+{
+    if (cur_heap->fixed) {
+	return;
     }
+    if (cur_heap->region_brk > cur_heap->region_base) {
+	mmap(cur_heap->region_base, cur_heap->region_brk - cur_heap->region_base, PROT_NONE
+	     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    }
+    cur_heap->region_brk = cur_heap->region_base;
+}
+
+// The current end of the heap, like sbrk(0).
+static void *heap_top(void)
+{
+    return cur_heap->use_region ? cur_heap->region_brk : sbrk(0);
+}
 
+// Grows the heap by bytes, like sbrk(bytes).
+static void *heap_more(size_t bytes)
+{
+    return cur_heap->use_region ? region_more(bytes) : sbrk(bytes);
+}
 
-    // Check if our data structure is NULL and initialize it if so
-    // This will involve a system call to sbrk()
-    if(block_list_head == NULL) {
-	block_list_head = sbrk(size_to_request * min_sbrk_size);
-	if(new_heap_node == (void *)-1) {
-	    if(isVerbose) {
-		fprintf(vikalloc_log_stream, "<< %d: %s sbrk failure", __LINE__, __FUNCTION__);
+uint8_t vikalloc_set_huge_pages(uint8_t enable)
+{
+    if (cur_heap->block_list_head != NULL || (enable ? TRUE : FALSE) == cur_heap->use_huge_pages
+	|| cur_heap->map_base != NULL) {
+	// The heap can only change where it comes from while it is empty,
+	// and a vikheap_create() heap always uses its own region.
+	return cur_heap->use_huge_pages;
+    }
+    if (enable) {
+	cur_heap->region_base = region_reserve(HUGE_REGION_RESERVE);
+	if (NULL == cur_heap->region_base) {
+	    if (IS_VERBOSE) {
+		fprintf(vikalloc_log_stream, "** Huge page region not available\n");
 	    }
-	    errno = ENOMEM;
-	    return NULL;
+	    return cur_heap->use_huge_pages;
 	}
-	block_list_head->capacity = (size_to_request * min_sbrk_size) - BLOCK_SIZE;
-	block_list_head->size = size;
-	next_fit = block_list_head;
-	block_list_tail = block_list_head;
-	block_list_head->next = NULL;
-	block_list_head->prev = NULL;
-	high_water_mark = sbrk(0);
-	return BLOCK_DATA(next_fit);
+	cur_heap->region_brk = cur_heap->region_base;
+	cur_heap->region_end = cur_heap->region_base + HUGE_REGION_RESERVE;
+	cur_heap->use_region = TRUE;
+	cur_heap->use_huge_pages = TRUE;
+	cur_heap->low_water_mark = cur_heap->region_base;
+	cur_heap->high_water_mark = cur_heap->region_base;
+    } else {
+	region_release();
+	munmap(cur_heap->region_base, cur_heap->region_end - cur_heap->region_base);
+	cur_heap->region_base = cur_heap->region_brk = cur_heap->region_end = NULL;
+	cur_heap->use_region = FALSE;
+	cur_heap->use_huge_pages = FALSE;
+	cur_heap->low_water_mark = NULL;
+	cur_heap->high_water_mark = NULL;
     }
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "** Huge pages %s\n"
+		, cur_heap->use_huge_pages ? "enabled" : "disabled");
+    }
+    return cur_heap->use_huge_pages;
+}
 
-    // Traverse the data structure to see if there is enough memory already we
-    // can use
-    // If there is a spot that already exists that can fufill our request we
-    // need to perform a split
-    do {
-	if((CURR_EXCESS_CAPACITY(curr)) >= (size + BLOCK_SIZE)) {
-	    // There exists an already freed heap node, so we can use this
-	    // without needing to split
-	    if(0 == curr->size) {
-		curr->size = size;
-		next_fit = curr;
-		return BLOCK_DATA(curr);
-	    } else {
-		// perform split
-		next_fit = (void *)curr + BLOCK_SIZE + curr->size;
-		next_fit->next = curr->next;
-		next_fit->prev = curr;
-		next_fit->size = size;
-		next_fit->capacity = CURR_EXCESS_CAPACITY(curr) - BLOCK_SIZE;
-		if(next_fit->next == NULL) { 
-		    block_list_tail = next_fit;
-		} else {
-		    next_fit->next->prev = next_fit;
-		}
+// Adds up how much of [start, end) is backed by huge pages, transparent
+// or hugetlbfs, from /proc/self/smaps.
+// This uses read() and sscanf() instead of stdio so that it does not
+// malloc(), which could move the program break out from under the heap.
+static size_t smaps_huge_bytes(void *start, void *end)
+{
+    char buf[4096];
+    char line[256];
+    size_t line_len = 0;
+    size_t total_kb = 0;
+    uint8_t in_range = FALSE;
+    unsigned long lo = 0;
+    unsigned long hi = 0;
+    unsigned long kb = 0;
+    ssize_t nread = 0;
+    ssize_t i = 0;
+    int fd = -1;
 
-		curr->capacity = curr->size;
-		curr->next = next_fit;
-		return BLOCK_DATA(next_fit);
+    if (start >= end) {
+	return 0;
+    }
+    fd = open("/proc/self/smaps", O_RDONLY);
+    if (fd < 0) {
+	return 0;
+    }
+    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+	for (i = 0; i < nread; i++) {
+	    if (buf[i] != '\n') {
+		if (line_len < sizeof(line) - 1) {
+		    line[line_len++] = buf[i];
+		}
+		continue;
 	    }
-	} else {
-	    if(curr->next == NULL) {
-		curr = block_list_head;
-	    } else {
-		curr = curr->next;
+	    line[line_len] = '\0';
+	    line_len = 0;
+	    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+		// The start of a new mapping.
+		in_range = (lo < (uintptr_t) end && hi > (uintptr_t) start);
+	    } else if (in_range
+		       && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1
+			   || sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1
+			   || sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1)) {
+		total_kb += kb;
 	    }
 	}
-    } while(curr != next_fit);
+    }
+    close(fd);
+    return total_kb * 1024;
+}
 
-    if(data_block == NULL) {
-	// wasn't a space to add our data, make a system call to sbrk to
-	// have more allocated
-	new_heap_node = sbrk(size_to_request * min_sbrk_size);
-	if(new_heap_node == (void *)-1) {
-	    if(isVerbose) {
-		fprintf(vikalloc_log_stream, "<< %d: %s sbrk failure", __LINE__, __FUNCTION__);
-	    }
-	    errno = ENOMEM;
-	    return NULL;
+// Counts the bytes of [start, end) that are resident, using mincore().
+static size_t resident_bytes(void *start, void *end)
+{
+    unsigned char vec[1024];
+    uintptr_t lo = (uintptr_t) start & ~(page_size - 1);
+    uintptr_t hi = ((uintptr_t) end + page_size - 1) & ~(page_size - 1);
+    size_t pages = 0;
+    size_t resident = 0;
+    size_t i = 0;
+
+    for ( ; lo < hi; lo += pages * page_size) {
+	pages = MIN((hi - lo) / page_size, sizeof(vec));
+	if (mincore((void *) lo, pages * page_size, vec) != 0) {
+	    break;
+	}
+	for (i = 0; i < pages; i++) {
+	    resident += vec[i] & 1;
 	}
-	new_heap_node->next = NULL;
-	new_heap_node->prev = block_list_tail;
-	new_heap_node->capacity = (size_to_request * min_sbrk_size) - BLOCK_SIZE;
-	new_heap_node->size = size;
-	block_list_tail->next = new_heap_node;
-	block_list_tail = new_heap_node;
-	data_block = BLOCK_DATA(new_heap_node);
     }
+    return resident * page_size;
+}
 
-    high_water_mark = sbrk(0);
-
+// Fills in the statistics about the block heap of cur_heap.
+static void heap_get_stats(vikalloc_stats_t *stats)
+{
+    heap_block_t *curr = NULL;
+    checkpoint_t *level = NULL;
 
-    if (isVerbose) {
-	fprintf(vikalloc_log_stream, "<< %d: %s exit: size = %lu\n", __LINE__, __FUNCTION__, size);
+    memset(stats, 0, sizeof(vikalloc_stats_t));
+    if (0 == page_size) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    stats->purged_bytes = purged_bytes;
+    stats->search_skips = cur_heap->search_skips;
+    if (cur_heap->low_water_mark == NULL || cur_heap->high_water_mark == NULL) {
+	return;
+    }
+    stats->heap_bytes = cur_heap->high_water_mark - cur_heap->low_water_mark;
+    stats->huge_page_bytes = MIN(smaps_huge_bytes(cur_heap->low_water_mark
+						 , cur_heap->high_water_mark)
+				 , stats->heap_bytes);
+    stats->rss_bytes = resident_bytes(cur_heap->low_water_mark, cur_heap->high_water_mark);
+    for (curr = cur_heap->block_list_head; curr != NULL; curr = curr->next) {
+	stats->live_bytes += CURR_SIZE(curr);
+    }
+    // The heaps under the open checkpoints are still part of this one.
+    for (level = cur_heap->checkpoint; level != NULL; level = level->saved.checkpoint) {
+	if (level->saved.low_water_mark != NULL && level->saved.high_water_mark != NULL) {
+	    stats->heap_bytes += level->saved.high_water_mark - level->saved.low_water_mark;
+	    stats->rss_bytes += resident_bytes(level->saved.low_water_mark
+					       , level->saved.high_water_mark);
+	}
+	for (curr = level->saved.block_list_head; curr != NULL; curr = curr->next) {
+	    stats->live_bytes += CURR_SIZE(curr);
+	}
     }
-
-    return data_block;
 }
 
+static size_t cache_total(void);
+static size_t transfer_total(void);
 
+void vikalloc_get_stats(vikalloc_stats_t *stats)
+{
+    uint8_t locked = heap_lock_take();
 
-void vikfree(void *ptr)
+    heap_get_stats(stats);
+    // Medium objects only come from the default heap.
+    stats->medium_bytes = medium_brk - medium_base;
+    stats->live_bytes += medium_in_use;
+    stats->rss_bytes += resident_bytes(medium_base, medium_brk);
+    // So do large objects.
+    stats->large_bytes = large_mapped;
+    stats->large_remaps = large_remaps;
+    stats->live_bytes += large_in_use;
+    stats->cache_bytes = cache_total();
+    stats->transfer_bytes = transfer_total();
+    stats->maint_passes = maint_passes;
+    stats->maint_frees = maint_frees;
+    stats->maint_trimmed_bytes = maint_trimmed_bytes;
+    stats->maint_flushed_bytes = maint_flushed_bytes;
+    stats->maint_busy_us = maint_busy_us;
+    stats->streamed_bytes = __atomic_load_n(&streamed_bytes, __ATOMIC_RELAXED);
+    heap_lock_drop(locked);
+}
+
+// Gives a block that is going on the free list a side table entry.
+static void side_attach(heap_block_t *curr)
 {
-    heap_block_t *curr = NULL;
+    side_entry_t *entry = cur_heap->side_table_free;
 
-    if (ptr == NULL) {
-	return;
+    if (entry != NULL) {
+	cur_heap->side_table_free = entry->next_entry;
+    } else {
+	assert(cur_heap->side_table_used < SIDE_TABLE_ENTRIES);
+	entry = &cur_heap->side_table[cur_heap->side_table_used++];
     }
+    entry->block = curr;
+    entry->excess = CURR_EXCESS_CAPACITY(curr);
+    SIDE_ENTRY(curr) = entry;
+}
 
-    // Get the data structure that holds the passed in data
-    curr = DATA_BLOCK(ptr);
+static void side_detach(side_entry_t *entry)
+{
+    entry->block = NULL;
+    entry->next_entry = cur_heap->side_table_free;
+    cur_heap->side_table_free = entry;
+}
 
-    if(curr == NULL) {
-	return;
-    }
+static void side_table_reset(void)
+{
+    cur_heap->side_table_used = 0;
+    cur_heap->side_table_free = NULL;
+    cur_heap->side_head = NULL;
+}
 
-    if (IS_FREE(curr)) {
-	if (isVerbose) {
-	    fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
-		    , (long) (ptr - low_water_mark));
-	}
-	return;
+// Moves the links of every block on a free list from its side table
+// entry back into the block, where the entry pointer was.
+static void side_table_unlink(heap_block_t *curr)
+{
+    side_entry_t *entry = NULL;
+
+    while (curr != NULL) {
+	entry = SIDE_ENTRY(curr);
+	*(free_links_t *) FREE_TAIL(curr) = entry->links;
+	curr = entry->links.next_free;
     }
+}
 
-    curr->size = 0;
-    next_fit = curr;
+// Turns the side table off when it has no entry left for another free
+// block. The lists of any open checkpoints go back in their blocks
+// too, so a rollback or commit finds them the way it expects.
+static void side_table_full(void)
+{
+    checkpoint_t *checkpoint = NULL;
 
-    // Check for the three scenarios which we coalesce
-    //   If curr->next and curr->prev both are of size 0
-    //   Mark curr->next->size with a dummy value we can use to stop our recursive traversal
-    //   Recursively coalesce up from curr->prev
-    //
-    //   If curr->next is of size 0
-    //   Mark curr->next->size with a dummy value we can use to stop our recursive traversal
-    //   Recursively coalesce up from curr
-    //
-    //   If curr->previous is of size 0
-    //   Mark curr->size with a dummy value we can use to stop our recursive traversal
-    //   Recursively coalesce up from curr->prev
-    if((curr->next != NULL && IS_FREE(curr->next)) && (curr->prev != NULL && IS_FREE(curr->prev))) {
-	curr->next->size = 1;
-	next_fit = curr->prev;
-	coalesce_up(curr->prev);
-    } else if(curr->next != NULL && IS_FREE(curr->next)) {
-	curr->next->size = 1;
-	next_fit = curr;
-	coalesce_up(curr);
-    } else if(curr->prev != NULL && IS_FREE(curr->prev)) {
-	curr->size = 1;
-	next_fit = curr->prev;
-	coalesce_up(curr->prev);
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "** Free list side table full\n");
     }
-    
-    if (isVerbose) {
-	fprintf(vikalloc_log_stream, "<< %d: %s exit: ptr = %p\n", __LINE__, __FUNCTION__, ptr);
+    side_table_unlink(cur_heap->free_list_head);
+    for (checkpoint = cur_heap->checkpoint; checkpoint != NULL
+	     ; checkpoint = checkpoint->saved.checkpoint) {
+	side_table_unlink(checkpoint->saved.free_list_head);
+	checkpoint->saved.use_side_table = FALSE;
     }
+    cur_heap->use_side_table = FALSE;
+    side_table_reset();
 }
 
+static uint32_t treap_seed = 2463534242U;
 
-void coalesce_up(heap_block_t * ptr) {
-    heap_block_t * next = NULL;
-    if(ptr->size != 0) {
+static size_t treap_max(treap_node_t *node)
+{
+    return (node != NULL) ? node->max_excess : 0;
+}
+
+static void treap_fix(treap_node_t *node)
+{
+    node->max_excess = MAX(node->excess, MAX(treap_max(node->left), treap_max(node->right)));
+}
+
+// Splits the tree at node into the blocks below key and the rest.
+static void treap_split(treap_node_t *node, heap_block_t *key
+			, treap_node_t **lo, treap_node_t **hi)
+{
+    if (NULL == node) {
+	*lo = NULL;
+	*hi = NULL;
 	return;
-    } else {
-	coalesce_up(ptr->next);
     }
-
-    next = ptr->next;
-    ptr->capacity += next->capacity + BLOCK_SIZE;
-    if(next->next) {
-	next->next->prev = ptr;
+    if (node->block < key) {
+	treap_split(node->right, key, &node->right, hi);
+	*lo = node;
     } else {
-	block_list_tail = ptr;
+	treap_split(node->left, key, lo, &node->left);
+	*hi = node;
     }
+    treap_fix(node);
+}
 
-    ptr->next = next->next;
+// Joins two trees, where every block in lo is below every block in hi.
+static treap_node_t *treap_merge(treap_node_t *lo, treap_node_t *hi)
+{
+    if (NULL == lo) {
+	return hi;
+    }
+    if (NULL == hi) {
+	return lo;
+    }
+    if (lo->priority > hi->priority) {
+	lo->right = treap_merge(lo->right, hi);
+	treap_fix(lo);
+	return lo;
+    }
+    hi->left = treap_merge(lo, hi->left);
+    treap_fix(hi);
+    return hi;
 }
 
+static void treap_insert(heap_block_t *curr)
+{
+    treap_node_t *node = cur_heap->treap_free;
+    treap_node_t *lo = NULL;
+    treap_node_t *hi = NULL;
 
-///////////////
+    if (node != NULL) {
+	cur_heap->treap_free = node->left;
+    } else {
+	assert(cur_heap->treap_used < TREAP_NODES);
+	node = &cur_heap->treap_slab[cur_heap->treap_used++];
+    }
+    // xorshift32
+    treap_seed ^= treap_seed << 13;
+    treap_seed ^= treap_seed >> 17;
+    treap_seed ^= treap_seed << 5;
+    node->block = curr;
+    node->excess = CURR_EXCESS_CAPACITY(curr);
+    node->max_excess = node->excess;
+    node->priority = treap_seed;
+    node->left = NULL;
+    node->right = NULL;
+    treap_split(cur_heap->treap_root, curr, &lo, &hi);
+    cur_heap->treap_root = treap_merge(treap_merge(lo, node), hi);
+}
 
-void vikalloc_reset(void)
+static void treap_erase(treap_node_t **link, heap_block_t *curr)
 {
-    if (low_water_mark != NULL) {
-	if (isVerbose) {
-	    fprintf(vikalloc_log_stream, "*** Resetting all vikalloc space ***\n");
-	}
+    treap_node_t *node = *link;
 
-	brk(low_water_mark);
-	high_water_mark = low_water_mark;
+    if (NULL == node) {
+	return;
+    }
+    if (node->block == curr) {
+	*link = treap_merge(node->left, node->right);
+	node->left = cur_heap->treap_free;
+	cur_heap->treap_free = node;
+	return;
+    }
+    treap_erase((curr < node->block) ? &node->left : &node->right, curr);
+    treap_fix(node);
+}
 
-	block_list_head = NULL;
-	block_list_tail = NULL;
-	next_fit = NULL;
+// Call when the excess capacity of a block in the tree has changed.
+static void treap_update(treap_node_t *node, heap_block_t *curr)
+{
+    if (NULL == node) {
+	return;
+    }
+    if (node->block == curr) {
+	node->excess = CURR_EXCESS_CAPACITY(curr);
+    } else {
+	treap_update((curr < node->block) ? node->left : node->right, curr);
     }
+    treap_fix(node);
 }
 
-void * vikcalloc(size_t nmemb, size_t size)
+// Returns the lowest block in the tree with at least need bytes of
+// excess capacity, or NULL if there is none.
+static heap_block_t *treap_search(size_t need)
 {
-    void *ptr = vikalloc(nmemb * size);
-    if(ptr == NULL) {
+    treap_node_t *node = cur_heap->treap_root;
+
+    if (treap_max(node) < need) {
 	return NULL;
     }
+    for (;;) {
+	if (treap_max(node->left) >= need) {
+	    node = node->left;
+	} else if (node->excess >= need) {
+	    return node->block;
+	} else {
+	    node = node->right;
+	}
+    }
+}
 
-    memset(ptr, 0, nmemb * size);
-    return ptr;
+static void treap_reset(void)
+{
+    cur_heap->treap_used = 0;
+    cur_heap->treap_free = NULL;
+    cur_heap->treap_root = NULL;
 }
 
-void * vikrealloc(void *ptr, size_t size)
+// Turns the first fit index off when the slab has no node left for
+// another free block. first_fit_search() then walks the free list, and
+// open checkpoints drop their part of the index too.
+static void treap_full(void)
 {
-    heap_block_t *curr = NULL;
-    void * new_heap_node = NULL;
+    checkpoint_t *checkpoint = NULL;
 
-    if(ptr == NULL) {
-	return vikalloc(size);
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "** First fit index full\n");
+    }
+    for (checkpoint = cur_heap->checkpoint; checkpoint != NULL
+	     ; checkpoint = checkpoint->saved.checkpoint) {
+	checkpoint->saved.use_treap = FALSE;
+	checkpoint->saved.treap_full = TRUE;
+	checkpoint->saved.treap_root = NULL;
+    }
+    cur_heap->use_treap = FALSE;
+    cur_heap->treap_full = TRUE;
+    treap_reset();
+}
+
+// Unlinks a block from the free list and returns the block that
+// followed it on the list.
+// The links are found from the capacity, so this still works after the
+// size of the block has been changed.
+static heap_block_t *free_list_remove(heap_block_t *curr)
+{
+    free_links_t *links = FREE_LINKS(curr);
+    heap_block_t *next = links->next_free;
+
+    if (links->prev_free != NULL) {
+	FREE_LINKS(links->prev_free)->next_free = next;
+	FREE_LINKS(links->prev_free)->next_capacity = links->next_capacity;
+    } else {
+	cur_heap->free_list_head = next;
+    }
+    if (next != NULL) {
+	FREE_LINKS(next)->prev_free = links->prev_free;
+    } else {
+	cur_heap->free_list_tail = links->prev_free;
+    }
+    if (cur_heap->free_list_rover == curr) {
+	cur_heap->free_list_rover = next;
+    }
+    if (cur_heap->use_treap) {
+	treap_erase(&cur_heap->treap_root, curr);
+    }
+    if (cur_heap->use_side_table) {
+	if (links->prev_free != NULL) {
+	    SIDE_ENTRY(links->prev_free)->next_entry = SIDE_ENTRY(curr)->next_entry;
+	} else {
+	    cur_heap->side_head = SIDE_ENTRY(curr)->next_entry;
+	}
+	side_detach(SIDE_ENTRY(curr));
+    }
+    return next;
+}
+
+// Links a block into the free list right after prev, or at the head
+// of the list if prev is NULL.
+static void free_list_insert_after(heap_block_t *prev, heap_block_t *curr)
+{
+    free_links_t *links = NULL;
+
+    assert(IS_AVAIL(curr));
+    MISS_BOUND_RAISE(curr);
+    if (cur_heap->use_treap && NULL == cur_heap->treap_free
+	&& cur_heap->treap_used >= TREAP_NODES) {
+	treap_full();
+    }
+    if (cur_heap->use_treap) {
+	treap_insert(curr);
+    }
+    if (cur_heap->use_side_table && NULL == cur_heap->side_table_free
+	&& cur_heap->side_table_used >= SIDE_TABLE_ENTRIES) {
+	side_table_full();
+    }
+    if (cur_heap->use_side_table) {
+	side_attach(curr);
+	if (prev != NULL) {
+	    SIDE_ENTRY(curr)->next_entry = SIDE_ENTRY(prev)->next_entry;
+	    SIDE_ENTRY(prev)->next_entry = SIDE_ENTRY(curr);
+	} else {
+	    SIDE_ENTRY(curr)->next_entry = cur_heap->side_head;
+	    cur_heap->side_head = SIDE_ENTRY(curr);
+	}
+    }
+    links = FREE_LINKS(curr);
+    links->prev_free = prev;
+    if (prev != NULL) {
+	links->next_free = FREE_LINKS(prev)->next_free;
+	links->next_capacity = FREE_LINKS(prev)->next_capacity;
+	FREE_LINKS(prev)->next_free = curr;
+	FREE_LINKS(prev)->next_capacity = curr->capacity;
+    } else {
+	links->next_free = cur_heap->free_list_head;
+	links->next_capacity = (cur_heap->free_list_head != NULL)
+	    ? cur_heap->free_list_head->capacity : 0;
+	cur_heap->free_list_head = curr;
+    }
+    if (links->next_free != NULL) {
+	FREE_LINKS(links->next_free)->prev_free = curr;
+    } else {
+	cur_heap->free_list_tail = curr;
+    }
+}
+
+// Finds the block that comes before curr on an address ordered free
+// list. This walks out from curr in both directions and stops at the
+// first block that is on the free list, so it costs the distance to the
+// nearest free block rather than the size of the heap.
+static heap_block_t *free_list_find_prev(heap_block_t *curr)
+{
+    heap_block_t *back = curr->prev;
+    heap_block_t *fwd = curr->next;
+
+    if (fwd == NULL) {
+	// New blocks at the end of the heap are the common case.
+	return cur_heap->free_list_tail;
+    }
+    while (back != NULL || fwd != NULL) {
+	if (back != NULL) {
+	    if (IS_AVAIL(back)) {
+		return back;
+	    }
+	    back = back->prev;
+	}
+	if (fwd != NULL) {
+	    if (IS_AVAIL(fwd)) {
+		return FREE_LINKS(fwd)->prev_free;
+	    }
+	    fwd = fwd->next;
+	}
+    }
+    return NULL;
+}
+
+// Puts a block on the free list where free_list_order says it goes.
+// The rover is moved back if the block lands between next_fit and the
+// current rover.
+static void free_list_insert(heap_block_t *curr)
+{
+    if (FREE_LIST_LIFO == FREE_LIST_ORDER) {
+	free_list_insert_after(NULL, curr);
+	return;
+    }
+    free_list_insert_after(free_list_find_prev(curr), curr);
+    if (curr >= cur_heap->next_fit
+	&& (cur_heap->free_list_rover == NULL || curr < cur_heap->free_list_rover)) {
+	cur_heap->free_list_rover = curr;
+    }
+}
+
+// Call after changing the size of a block that was (or was not) on the
+// free list before the change.
+static void free_list_update(heap_block_t *curr, uint8_t was_avail)
+{
+    if (was_avail && !IS_AVAIL(curr)) {
+	free_list_remove(curr);
+    } else if (!was_avail && IS_AVAIL(curr)) {
+	free_list_insert(curr);
+    } else if (was_avail) {
+	MISS_BOUND_RAISE(curr);
+	if (cur_heap->use_treap) {
+	    treap_update(cur_heap->treap_root, curr);
+	}
+	if (cur_heap->use_side_table) {
+	    SIDE_ENTRY(curr)->excess = CURR_EXCESS_CAPACITY(curr);
+	}
+    }
+}
+
+// Returns the first block on the free list with at least need bytes of
+// excess capacity, starting at the rover and wrapping around to the
+// head, or NULL if there is none. A search that finds nothing sets
+// miss_bound, so the next one for as much or more is skipped.
+static heap_block_t *free_list_search(size_t need)
+{
+    heap_block_t *curr = (cur_heap->free_list_rover != NULL)
+	? cur_heap->free_list_rover : cur_heap->free_list_head;
+    heap_block_t *start = curr;
+    heap_block_t *next = NULL;
+    free_links_t *links = NULL;
+    side_entry_t *entry = NULL;
+    size_t largest = 0;
+
+    if (NULL == curr) {
+	return NULL;
+    }
+    if (use_search_hint && cur_heap->miss_bound != 0 && need >= cur_heap->miss_bound) {
+	cur_heap->search_skips++;
+	return NULL;
+    }
+    if (cur_heap->use_side_table) {
+	// The blocks themselves aren't touched until one fits.
+	entry = SIDE_ENTRY(curr);
+	do {
+	    if (use_prefetch && entry->next_entry != NULL) {
+		__builtin_prefetch(entry->next_entry->next_entry);
+	    }
+	    if (entry->excess >= need) {
+		return entry->block;
+	    }
+	    largest = MAX(largest, entry->excess);
+	    entry = (entry->next_entry != NULL) ? entry->next_entry : cur_heap->side_head;
+	} while (entry->block != start);
+	cur_heap->miss_bound = largest + 1;
+	return NULL;
+    }
+    do {
+	// Following the links is a chain of dependent loads: the header
+	// says where the links are, and the links say where the next
+	// header is. next_capacity lets both lines of the next block be
+	// fetched at once, while this block is checked.
+	links = FREE_LINKS(curr);
+	next = links->next_free;
+	if (use_prefetch && next != NULL) {
+	    __builtin_prefetch(next);
+	    __builtin_prefetch(BLOCK_DATA(next) + links->next_capacity
+			       - sizeof(free_links_t));
+	}
+	if (CURR_EXCESS_CAPACITY(curr) >= need) {
+	    return curr;
+	}
+	largest = MAX(largest, CURR_EXCESS_CAPACITY(curr));
+	curr = (next != NULL) ? next : cur_heap->free_list_head;
+    } while (curr != start);
+    cur_heap->miss_bound = largest + 1;
+    return NULL;
+}
+
+// Throws away the free list and builds it again from the block list.
+static void free_list_rebuild(void)
+{
+    heap_block_t *curr = NULL;
+
+    cur_heap->free_list_head = NULL;
+    cur_heap->free_list_tail = NULL;
+    cur_heap->free_list_rover = NULL;
+    side_table_reset();
+    treap_reset();
+    for (curr = cur_heap->block_list_head; curr != NULL; curr = curr->next) {
+	if (IS_AVAIL(curr)) {
+	    free_list_insert_after(cur_heap->free_list_tail, curr);
+	    if (cur_heap->free_list_rover == NULL && curr >= cur_heap->next_fit) {
+		cur_heap->free_list_rover = curr;
+	    }
+	}
+    }
+}
+
+void vikalloc_set_free_list_order(vikalloc_free_list_order_t order)
+{
+    if (cur_heap->checkpoint != NULL) {
+	// The blocks from before the checkpoint can't be relinked.
+	return;
+    }
+    cur_heap->free_list_order = order;
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "** %s ordered free list selected\n"
+		, (FREE_LIST_LIFO == order) ? "LIFO" : "Address");
+    }
+    // The existing list may not be in the new order.
+    free_list_rebuild();
+}
+
+// Turns on the first fit index for cur_heap, if it can have one.
+static void treap_enable(void)
+{
+    static uint8_t treap_failed = FALSE;
+
+    if (cur_heap->shared || cur_heap->checkpoint != NULL || cur_heap->treap_full
+	|| treap_failed) {
+	// Rebuilding would relink blocks from before the checkpoint.
+	return;
+    }
+    if (NULL == cur_heap->treap_slab) {
+	cur_heap->treap_slab = mmap(NULL, TREAP_NODES * sizeof(treap_node_t)
+				    , PROT_READ | PROT_WRITE
+				    , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == cur_heap->treap_slab) {
+	    cur_heap->treap_slab = NULL;
+	    treap_failed = TRUE;
+	    if (IS_VERBOSE) {
+		fprintf(vikalloc_log_stream, "** First fit index not available\n");
+	    }
+	    return;
+	}
+    }
+    cur_heap->use_treap = TRUE;
+    free_list_rebuild();
+}
+
+// Returns the lowest block on the free list with at least need bytes of
+// excess capacity. Without the index, walking an address ordered list
+// from its head gives the same block.
+static heap_block_t *first_fit_search(size_t need)
+{
+    if (!cur_heap->use_treap) {
+	treap_enable();
+    }
+    if (cur_heap->use_treap) {
+	return treap_search(need);
+    }
+    cur_heap->free_list_rover = NULL;
+    return free_list_search(need);
+}
+
+void vikalloc_set_prefetch(uint8_t enable)
+{
+    use_prefetch = enable ? TRUE : FALSE;
+}
+
+void vikalloc_set_search_hint(uint8_t enable)
+{
+    use_search_hint = enable ? TRUE : FALSE;
+}
+
+uint8_t vikalloc_set_side_table(uint8_t enable)
+{
+    if (cur_heap->checkpoint != NULL) {
+	return cur_heap->use_side_table;
+    }
+    if (enable && NULL == cur_heap->side_table) {
+	cur_heap->side_table = mmap(NULL, SIDE_TABLE_ENTRIES * sizeof(side_entry_t)
+			  , PROT_READ | PROT_WRITE
+			  , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == cur_heap->side_table) {
+	    cur_heap->side_table = NULL;
+	    if (IS_VERBOSE) {
+		fprintf(vikalloc_log_stream, "** Free list side table not available\n");
+	    }
+	    return cur_heap->use_side_table;
+	}
+    }
+    cur_heap->use_side_table = enable ? TRUE : FALSE;
+    // The links move between the blocks and the table.
+    free_list_rebuild();
+    return cur_heap->use_side_table;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Hands the whole pages inside a free block back to the kernel. The
+// first page (with the header and stamp) and the last page (with the
+// free list links) are kept. With a huge page heap, only whole huge pages
+// are purged so the kernel does not have to break them up.
+static void purge_block(heap_block_t *curr)
+{
+    free_stamp_t *stamp = FREE_STAMP(curr);
+    uintptr_t gran = cur_heap->use_huge_pages ? HUGE_PAGE_SIZE : page_size;
+    uintptr_t lo = ((uintptr_t) (stamp + 1) + gran - 1) & ~(gran - 1);
+    uintptr_t hi = (uintptr_t) FREE_TAIL(curr) & ~(gran - 1);
+    int advice = MADV_DONTNEED;
+
+    stamp->purged = TRUE;
+    if (hi <= lo || (hi - lo) < PURGE_MIN_BYTES) {
+	return;
+    }
+# ifdef MADV_FREE
+    if (PURGE_FREE == purge_advice) {
+	advice = MADV_FREE;
+    }
+# endif // MADV_FREE
+    if (madvise((void *) lo, hi - lo, advice) != 0) {
+	// Older kernels don't know MADV_FREE.
+	if (advice == MADV_DONTNEED || madvise((void *) lo, hi - lo, MADV_DONTNEED) != 0) {
+	    return;
+	}
+    }
+    purged_bytes += hi - lo;
+}
+
+// Called for every block that vikfree() leaves free.
+static void purge_note_free(heap_block_t *curr)
+{
+    uint64_t now = 0;
+
+    // The pages of a caller's buffer are the caller's.
+    if (cur_heap->fixed) {
+	return;
+    }
+    if (!IS_AVAIL(curr) || (curr->capacity < PURGE_MIN_BYTES)) {
+	return;
+    }
+    if (0 == purge_decay_ms) {
+	purge_block(curr);
+	return;
+    }
+    now = now_ms();
+    FREE_STAMP(curr)->freed_ms = now;
+    FREE_STAMP(curr)->purged = FALSE;
+    // The maintenance thread does the passes then.
+    if (!maint_running && now - purge_last_ms >= purge_decay_ms) {
+	vikalloc_purge();
+    }
+}
+
+size_t vikalloc_purge(void)
+{
+    heap_block_t *curr = NULL;
+    size_t before = purged_bytes;
+    uint64_t now = 0;
+    uint8_t locked = FALSE;
+
+    if (PURGE_NONE == purge_advice) {
+	return 0;
+    }
+    locked = heap_lock_take();
+    now = now_ms();
+    purge_last_ms = now;
+    for (curr = cur_heap->free_list_head; curr != NULL; curr = FREE_LINKS(curr)->next_free) {
+	if (IS_FREE(curr) && curr->capacity >= PURGE_MIN_BYTES
+	    && !FREE_STAMP(curr)->purged
+	    && now - FREE_STAMP(curr)->freed_ms >= purge_decay_ms) {
+	    purge_block(curr);
+	}
+    }
+    if (IS_VERBOSE && purged_bytes != before) {
+	fprintf(vikalloc_log_stream, "** Purged %lu bytes\n"
+		, (unsigned long) (purged_bytes - before));
+    }
+    heap_lock_drop(locked);
+    return purged_bytes - before;
+}
+
+void vikalloc_set_purge(vikalloc_purge_advice_t advice, unsigned decay_ms)
+{
+    heap_block_t *curr = NULL;
+
+    if (0 == page_size) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    purge_advice = advice;
+    purge_decay_ms = decay_ms;
+    purge_last_ms = now_ms();
+    if (PURGE_NONE == advice) {
+	return;
+    }
+    // Blocks freed while purging was off have no stamp yet. Start their
+    // decay now.
+    for (curr = cur_heap->free_list_head; curr != NULL; curr = FREE_LINKS(curr)->next_free) {
+	if (IS_FREE(curr) && curr->capacity >= PURGE_MIN_BYTES) {
+	    FREE_STAMP(curr)->freed_ms = purge_last_ms;
+	    FREE_STAMP(curr)->purged = FALSE;
+	}
+    }
+}
+
+// The distance to the next sample is drawn uniformly from
+// [sample_rate / 2, 3 * sample_rate / 2), so allocations that recur with
+// a fixed period can't dodge the sampler.
+static long profile_next_countdown(void)
+{
+    sample_random ^= sample_random << 13;
+    sample_random ^= sample_random >> 7;
+    sample_random ^= sample_random << 17;
+    return (long) (sample_rate / 2 + sample_random % sample_rate);
+}
+
+static size_t profile_hash(void *ptr)
+{
+    return (((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL)
+	& (PROFILE_INDEX_SIZE - 1);
+}
+
+// Removes a pointer from profile_index. Linear probing, so the entries
+// after it are shifted back to close the gap.
+static void profile_index_remove(size_t slot)
+{
+    size_t next = (slot + 1) & (PROFILE_INDEX_SIZE - 1);
+    size_t home = 0;
+
+    profile_index[slot] = 0;
+    while (profile_index[next] != 0) {
+	home = profile_hash(profile_ring[profile_index[next] - 1].ptr);
+	// Move the entry back if the gap is between its home and next.
+	if (((next - home) & (PROFILE_INDEX_SIZE - 1))
+	    >= ((next - slot) & (PROFILE_INDEX_SIZE - 1))) {
+	    profile_index[slot] = profile_index[next];
+	    profile_index[next] = 0;
+	    slot = next;
+	}
+	next = (next + 1) & (PROFILE_INDEX_SIZE - 1);
+    }
+}
+
+// Finds the profile_index slot for a live sampled pointer, or returns
+// PROFILE_INDEX_SIZE if it was not sampled.
+static size_t profile_index_find(void *ptr)
+{
+    size_t slot = profile_hash(ptr);
+
+    while (profile_index[slot] != 0) {
+	if (profile_ring[profile_index[slot] - 1].ptr == ptr) {
+	    return slot;
+	}
+	slot = (slot + 1) & (PROFILE_INDEX_SIZE - 1);
+    }
+    return PROFILE_INDEX_SIZE;
+}
+
+// Records one sample. Called from vikalloc() when the countdown runs out.
+// Kept out of line so the first two frames of every backtrace are always
+// this function and vikalloc().
+static void profile_record(void *ptr, size_t size) __attribute__((noinline));
+static void profile_record(void *ptr, size_t size)
+{
+    profile_sample_t *sample = &profile_ring[profile_next];
+    size_t slot = 0;
+
+    if (sample->live) {
+	// The ring has wrapped onto a sample that was never freed.
+	profile_index_remove(profile_index_find(sample->ptr));
+	__atomic_sub_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+    }
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->when_ms = now_ms();
+    sample->live = TRUE;
+    sample->depth = backtrace(sample->frames, PROFILE_DEPTH);
+
+    slot = profile_hash(ptr);
+    while (profile_index[slot] != 0) {
+	slot = (slot + 1) & (PROFILE_INDEX_SIZE - 1);
+    }
+    profile_index[slot] = profile_next + 1;
+    __atomic_add_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+
+    profile_next = (profile_next + 1) % PROFILE_RING_SIZE;
+    profile_count = MIN(profile_count + 1, PROFILE_RING_SIZE);
+}
+
+// Called from vikfree() while there are live samples.
+static void profile_forget(void *ptr)
+{
+    size_t slot = profile_index_find(ptr);
+
+    if (slot < PROFILE_INDEX_SIZE) {
+	profile_ring[profile_index[slot] - 1].live = FALSE;
+	profile_index_remove(slot);
+	__atomic_sub_fetch(&profile_live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void vikalloc_profile_reset(void)
+{
+    memset(profile_ring, 0, sizeof(profile_ring));
+    memset(profile_index, 0, sizeof(profile_index));
+    profile_next = 0;
+    profile_count = 0;
+    __atomic_store_n(&profile_live, 0, __ATOMIC_RELAXED);
+    profile_start_ms = now_ms();
+}
+
+void vikalloc_set_sample_rate(size_t rate)
+{
+    void *frames[1];
+
+    if (rate != 0 && 0 == sample_rate) {
+	// The first backtrace() loads the unwinder, which allocates.
+	// Get that out of the way now instead of in the middle of vikalloc().
+	backtrace(frames, 1);
+	vikalloc_profile_reset();
+    }
+    sample_rate = rate;
+    if (rate != 0) {
+	sample_countdown = profile_next_countdown();
+    }
+}
+
+// Each sample stands for about sample_rate bytes of allocation, or its
+// own size if it is bigger than that.
+static size_t profile_weight(size_t size)
+{
+    return MAX(size, sample_rate);
+}
+
+void vikalloc_profile_dump(FILE *stream)
+{
+    static size_t site_of[PROFILE_RING_SIZE];
+    static uint8_t printed[PROFILE_RING_SIZE];
+    size_t live_bytes[PROFILE_RING_SIZE];
+    size_t alloc_bytes[PROFILE_RING_SIZE];
+    size_t samples[PROFILE_RING_SIZE];
+    size_t i = 0;
+    size_t j = 0;
+    size_t best = 0;
+    size_t sites = 0;
+    double seconds = 0.0;
+    profile_sample_t *a = NULL;
+    profile_sample_t *b = NULL;
+
+    if (NULL == stream) {
+	stream = vikalloc_log_stream;
+    }
+    seconds = (now_ms() - profile_start_ms) / 1000.0;
+    if (seconds <= 0.0) {
+	seconds = 0.001;
+    }
+
+    // Group the samples by call site (identical backtraces).
+    for (i = 0; i < profile_count; i++) {
+	a = &profile_ring[i];
+	for (j = 0; j < i; j++) {
+	    b = &profile_ring[site_of[j]];
+	    if (a->depth == b->depth
+		&& memcmp(a->frames, b->frames, a->depth * sizeof(void *)) == 0) {
+		break;
+	    }
+	}
+	site_of[i] = (j < i) ? site_of[j] : i;
+	if (site_of[i] == i) {
+	    live_bytes[i] = 0;
+	    alloc_bytes[i] = 0;
+	    samples[i] = 0;
+	    printed[i] = FALSE;
+	    sites++;
+	}
+	samples[site_of[i]]++;
+	alloc_bytes[site_of[i]] += profile_weight(a->size);
+	if (a->live) {
+	    live_bytes[site_of[i]] += profile_weight(a->size);
+	}
+    }
+
+    fprintf(stream, "Heap profile: sample rate %zu bytes, %zu samples"
+	    " (%zu live) from %zu sites over %.3f seconds\n"
+	    , sample_rate, profile_count, __atomic_load_n(&profile_live, __ATOMIC_RELAXED)
+	    , sites, seconds);
+    fprintf(stream, "  %12s\t%12s\t%12s\t%8s\n"
+	    , "live bytes", "alloc bytes", "alloc B/s", "samples");
+    fflush(stream);
+    // Biggest live bytes first.
+    for ( ; sites > 0; sites--) {
+	best = profile_count;
+	for (i = 0; i < profile_count; i++) {
+	    if (site_of[i] == i && !printed[i]
+		&& (best == profile_count || live_bytes[i] > live_bytes[best])) {
+		best = i;
+	    }
+	}
+	printed[best] = TRUE;
+	fprintf(stream, "  %12zu\t%12zu\t%12.0f\t%8zu\n"
+		, live_bytes[best], alloc_bytes[best]
+		, alloc_bytes[best] / seconds, samples[best]);
+	fflush(stream);
+	// backtrace_symbols_fd() does not allocate. Skip the profiler's
+	// own frames.
+	if (profile_ring[best].depth > 2) {
+	    backtrace_symbols_fd(profile_ring[best].frames + 2
+				 , profile_ring[best].depth - 2, fileno(stream));
+	}
+    }
+}
+
+// Medium size classes come from vikalloc_size_classes.h. The built-in
+// ones go up in quarter steps between powers of two: 256, 320, 384,
+// 448, 512, 640, ... 28672, 32768.
+static unsigned medium_class(size_t size)
+{
+    return medium_class_index[(size + MEDIUM_GRANULE - 1) / MEDIUM_GRANULE];
+}
+
+static size_t medium_class_size(unsigned cls)
+{
+    return medium_class_sizes[cls];
+}
+
+#define MEDIUM_RUN_BASE(__run) (medium_base \
+	    + ((size_t) ((__run) - medium_runs) << MEDIUM_RUN_SHIFT))
+
+// Reserves the arena and the descriptor table. Neither uses any memory
+// until it is touched.
+static uint8_t medium_reserve(void)
+{
+    void *raw = NULL;
+    uintptr_t aligned = 0;
+    size_t nruns = MEDIUM_ARENA_RESERVE / MEDIUM_RUN_SIZE;
+
+    raw = mmap(NULL, MEDIUM_ARENA_RESERVE + MEDIUM_RUN_SIZE, PROT_NONE
+	       , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == raw) {
+	return FALSE;
+    }
+    medium_runs = mmap(NULL, nruns * sizeof(medium_run_t), PROT_READ | PROT_WRITE
+		       , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == medium_runs) {
+	munmap(raw, MEDIUM_ARENA_RESERVE + MEDIUM_RUN_SIZE);
+	medium_runs = NULL;
+	return FALSE;
+    }
+    // Runs are aligned to their size, so a pointer finds its run with a shift.
+    aligned = ((uintptr_t) raw + MEDIUM_RUN_SIZE - 1) & ~((uintptr_t) MEDIUM_RUN_SIZE - 1);
+    medium_base = (void *) aligned;
+    medium_brk = medium_base;
+    medium_end = medium_base + MEDIUM_ARENA_RESERVE;
+    return TRUE;
+}
+
+static void medium_partial_push(unsigned cls, medium_run_t *run)
+{
+    run->prev = NULL;
+    run->next = medium_partial[cls];
+    if (run->next != NULL) {
+	run->next->prev = run;
+    }
+    medium_partial[cls] = run;
+}
+
+static void medium_partial_unlink(unsigned cls, medium_run_t *run)
+{
+    if (run->prev != NULL) {
+	run->prev->next = run->next;
+    } else {
+	medium_partial[cls] = run->next;
+    }
+    if (run->next != NULL) {
+	run->next->prev = run->prev;
+    }
+}
+
+// Gets a run for a size class, reusing an empty run if there is one.
+static medium_run_t *medium_new_run(unsigned cls)
+{
+    medium_run_t *run = medium_empty;
+    size_t i = 0;
+
+    if (run != NULL) {
+	medium_empty = run->next;
+    } else {
+	if (medium_brk >= medium_end
+	    || mmap(medium_brk, MEDIUM_RUN_SIZE, PROT_READ | PROT_WRITE
+		    , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	    return NULL;
+	}
+	run = &medium_runs[(medium_brk - medium_base) >> MEDIUM_RUN_SHIFT];
+	medium_brk += MEDIUM_RUN_SIZE;
+    }
+    run->slot_size = medium_class_size(cls);
+    run->nslots = MEDIUM_RUN_SIZE / run->slot_size;
+    run->nfree = run->nslots;
+    memset(run->bitmap, 0, sizeof(run->bitmap));
+    for (i = 0; i < run->nslots / 64u; i++) {
+	run->bitmap[i] = ~0ULL;
+    }
+    if (run->nslots % 64 != 0) {
+	run->bitmap[i] = (1ULL << (run->nslots % 64)) - 1;
+    }
+    medium_partial_push(cls, run);
+    return run;
+}
+
+static void *medium_alloc(size_t size)
+{
+    unsigned cls = medium_class(size);
+    medium_run_t *run = medium_partial[cls];
+    unsigned word = 0;
+    unsigned bit = 0;
+
+    if (NULL == run) {
+	run = medium_new_run(cls);
+	if (NULL == run) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+    // The first free slot is the lowest set bit of the first non-zero word.
+    while (0 == run->bitmap[word]) {
+	word++;
+    }
+    bit = __builtin_ctzll(run->bitmap[word]);
+    run->bitmap[word] &= run->bitmap[word] - 1;
+    if (0 == --run->nfree) {
+	medium_partial_unlink(cls, run);
+    }
+    medium_in_use += run->slot_size;
+    last_path = VIK_PATH_MEDIUM;
+    return MEDIUM_RUN_BASE(run) + ((size_t) ((word * 64) + bit) * run->slot_size);
+}
+
+static void medium_free(void *ptr)
+{
+    medium_run_t *run = &medium_runs[(ptr - medium_base) >> MEDIUM_RUN_SHIFT];
+    size_t offset = ptr - MEDIUM_RUN_BASE(run);
+    size_t slot = 0;
+    unsigned cls = 0;
+
+    last_path = VIK_PATH_MEDIUM_FREE;
+    if (0 == run->slot_size || offset % run->slot_size != 0) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "Not a medium object: ptr = %p\n", ptr);
+	}
+	return;
+    }
+    slot = offset / run->slot_size;
+    if (run->bitmap[slot / 64] & (1ULL << (slot % 64))) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "Medium object already free: ptr = %p\n", ptr);
+	}
+	return;
+    }
+    run->bitmap[slot / 64] |= 1ULL << (slot % 64);
+    medium_in_use -= run->slot_size;
+    cls = medium_class(run->slot_size);
+    if (1 == ++run->nfree) {
+	medium_partial_push(cls, run);
+    }
+    if (run->nfree == run->nslots
+	&& (medium_partial[cls] != run || run->next != NULL)) {
+	// One empty run stays with its class, so a class that hovers
+	// around one object doesn't take a new run every time.
+	medium_partial_unlink(cls, run);
+	run->slot_size = 0;
+	run->next = medium_empty;
+	medium_empty = run;
+	if (purge_advice != PURGE_NONE
+	    && madvise(MEDIUM_RUN_BASE(run), MEDIUM_RUN_SIZE, MADV_DONTNEED) == 0) {
+	    purged_bytes += MEDIUM_RUN_SIZE;
+	}
+    }
+}
+
+// The number of bytes the caller can use at a medium object.
+static size_t medium_usable(void *ptr)
+{
+    return medium_runs[(ptr - medium_base) >> MEDIUM_RUN_SHIFT].slot_size;
+}
+
+// Hands every run back to the kernel, for vikalloc_reset().
+static void medium_release(void)
+{
+    if (medium_brk > medium_base) {
+	mmap(medium_base, medium_brk - medium_base, PROT_NONE
+	     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+	memset(medium_runs, 0
+	       , ((medium_brk - medium_base) >> MEDIUM_RUN_SHIFT) * sizeof(medium_run_t));
+    }
+    medium_brk = medium_base;
+    medium_empty = NULL;
+    medium_in_use = 0;
+    memset(medium_partial, 0, sizeof(medium_partial));
+}
+
+uint8_t vikalloc_set_medium(uint8_t enable)
+{
+    if (enable && NULL == medium_base && !medium_reserve()) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "** Medium object arena not available\n");
+	}
+	return use_medium;
+    }
+    // Objects already in the arena can still be freed after this is
+    // turned off.
+    use_medium = enable ? TRUE : FALSE;
+    return use_medium;
+}
+
+// Rounds a large object of size bytes up to the pages that hold it,
+// or returns 0 if that doesn't fit in a size_t.
+static size_t large_map_bytes(size_t size)
+{
+    if (0 == page_size) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    if (size > SIZE_MAX - LARGE_HEADER - page_size) {
+	return 0;
+    }
+    return (size + LARGE_HEADER + page_size - 1) & ~(page_size - 1);
+}
+
+static void *large_alloc(size_t size)
+{
+    size_t map_bytes = large_map_bytes(size);
+    large_block_t *large = NULL;
+    heap_block_t *curr = NULL;
+
+    if (0 == map_bytes) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    large = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE
+		 , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == large) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "<< %d: %s mmap failure", __LINE__, __FUNCTION__);
+	}
+	errno = ENOMEM;
+	return NULL;
+    }
+    large->prev = NULL;
+    large->next = large_head;
+    if (large_head != NULL) {
+	large_head->prev = large;
+    }
+    large_head = large;
+    large->map_bytes = map_bytes;
+    curr = (heap_block_t *) (large + 1);
+    curr->capacity = map_bytes - LARGE_HEADER;
+    curr->size = size;
+    curr->prev = NULL;
+    curr->next = curr;
+    large_mapped += map_bytes;
+    large_in_use += size;
+    last_path = VIK_PATH_GROW;
+    return BLOCK_DATA(curr);
+}
+
+static void large_free(void *ptr)
+{
+    heap_block_t *curr = DATA_BLOCK(ptr);
+    large_block_t *large = ((large_block_t *) curr) - 1;
+
+    if (large->prev != NULL) {
+	large->prev->next = large->next;
+    } else {
+	large_head = large->next;
+    }
+    if (large->next != NULL) {
+	large->next->prev = large->prev;
+    }
+    large_mapped -= large->map_bytes;
+    large_in_use -= curr->size;
+    munmap(large, large->map_bytes);
+    last_path = VIK_PATH_FREE;
+}
+
+// Resizes a large object by remapping its pages, which the kernel can
+// move without copying them. Returns NULL, with errno set to ENOMEM and
+// the object untouched, if it can't.
+static void *large_remap(void *ptr, size_t size)
+{
+    heap_block_t *curr = DATA_BLOCK(ptr);
+    large_block_t *large = ((large_block_t *) curr) - 1;
+    large_block_t *moved = large;
+    size_t old_bytes = large->map_bytes;
+    size_t map_bytes = large_map_bytes(size);
+
+    if (0 == map_bytes) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (map_bytes != old_bytes) {
+	moved = (large_block_t *) syscall(SYS_mremap, large, old_bytes, map_bytes
+					  , MREMAP_MAYMOVE);
+	if (MAP_FAILED == (void *) moved) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	large_remaps++;
+    }
+    if (moved != large) {
+	// The links came along with the pages, but what points at them
+	// didn't.
+	if (moved->prev != NULL) {
+	    moved->prev->next = moved;
+	} else {
+	    large_head = moved;
+	}
+	if (moved->next != NULL) {
+	    moved->next->prev = moved;
+	}
+	curr = (heap_block_t *) (moved + 1);
+	curr->next = curr;
+    }
+    moved->map_bytes = map_bytes;
+    large_mapped = large_mapped - old_bytes + map_bytes;
+    large_in_use = large_in_use - curr->size + size;
+    curr->capacity = map_bytes - LARGE_HEADER;
+    curr->size = size;
+    last_path = (moved == large) ? VIK_PATH_REALLOC_INPLACE : VIK_PATH_REALLOC_MOVE;
+    return BLOCK_DATA(curr);
+}
+
+static void large_release(void)
+{
+    large_block_t *next = NULL;
+
+    for ( ; large_head != NULL; large_head = next) {
+	next = large_head->next;
+	munmap(large_head, large_head->map_bytes);
+    }
+    large_mapped = 0;
+    large_in_use = 0;
+}
+
+void vikalloc_set_large_min(size_t min_size)
+{
+    large_min_size = min_size;
+}
+
+static uint64_t latency_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+}
+
+// Works out how long a tick is, by timing a couple of milliseconds
+// against the monotonic clock.
+static double latency_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts;
+    uint64_t ns0 = 0;
+    uint64_t ns1 = 0;
+    uint64_t ticks0 = 0;
+    uint64_t ticks1 = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns0 = ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+    ticks0 = latency_ticks();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns1 = ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+    } while (ns1 - ns0 < 2000000);
+    ticks1 = latency_ticks();
+    return (double) (ns1 - ns0) / (double) (ticks1 - ticks0);
+#else
+    return 1.0;
+#endif
+}
+
+static void latency_record(vikalloc_path_t path, uint64_t start)
+{
+    uint64_t ticks = latency_ticks() - start;
+    unsigned bucket = (ticks != 0) ? 63 - __builtin_clzll(ticks) : 0;
+
+    latency.count[path]++;
+    latency.buckets[path][bucket]++;
+    if (ticks > latency.max_ticks[path]) {
+	latency.max_ticks[path] = ticks;
+    }
+}
+
+void vikalloc_set_latency_tracking(uint8_t enable)
+{
+    if (enable && !latency_tracking) {
+	vikalloc_latency_reset();
+	latency.ns_per_tick = latency_calibrate();
+    }
+    latency_tracking = enable ? TRUE : FALSE;
+}
+
+void vikalloc_set_size_histogram(uint8_t enable)
+{
+    if (enable && !size_histogram_on) {
+	memset(size_histogram, 0, sizeof(size_histogram));
+    }
+    size_histogram_on = enable ? TRUE : FALSE;
+}
+
+void vikalloc_size_histogram_dump(FILE *stream)
+{
+    size_t i = 0;
+    size_t total = 0;
+
+    if (NULL == stream) {
+	stream = vikalloc_log_stream;
+    }
+    for (i = 0; i < SIZE_HISTOGRAM_BUCKETS; i++) {
+	total += __atomic_load_n(&size_histogram[i], __ATOMIC_RELAXED);
+    }
+    fprintf(stream, "# vikalloc request sizes, rounded up to %d bytes: size count\n"
+	    , SIZE_HISTOGRAM_GRANULE);
+    fprintf(stream, "# %lu requests, %lu over %d bytes\n", (unsigned long) total
+	    , (unsigned long) size_histogram[SIZE_HISTOGRAM_BUCKETS - 1], MEDIUM_MAX_SIZE);
+    for (i = 1; i < SIZE_HISTOGRAM_BUCKETS - 1; i++) {
+	if (size_histogram[i] != 0) {
+	    fprintf(stream, "%lu %lu\n", (unsigned long) (i * SIZE_HISTOGRAM_GRANULE)
+		    , (unsigned long) size_histogram[i]);
+	}
+    }
+}
+
+void vikalloc_latency_reset(void)
+{
+    double ns_per_tick = latency.ns_per_tick;
+
+    memset(&latency, 0, sizeof(latency));
+    latency.ns_per_tick = ns_per_tick;
+}
+
+void vikalloc_latency_get(vikalloc_latency_t *copy)
+{
+    memcpy(copy, &latency, sizeof(latency));
+}
+
+// Returns the upper end, in nanoseconds, of the bucket that holds the
+// given fraction of the calls on a path.
+static double latency_percentile(const vikalloc_latency_t *lat
+				 , vikalloc_path_t path, double fraction)
+{
+    uint64_t want = (uint64_t) (lat->count[path] * fraction);
+    uint64_t seen = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+	seen += lat->buckets[path][i];
+	if (seen > want) {
+	    break;
+	}
+    }
+    if (i >= 63) {
+	return lat->max_ticks[path] * lat->ns_per_tick;
+    }
+    return MIN((double) (2ULL << i), (double) lat->max_ticks[path])
+	* lat->ns_per_tick;
+}
+
+void vikalloc_latency_dump(FILE *stream)
+{
+    static const char *names[VIK_PATH_COUNT] = {
+	"alloc reuse"
+	, "alloc split"
+	, "alloc grow"
+	, "free"
+	, "free coalesce"
+	, "realloc in place"
+	, "realloc move"
+	, "medium alloc"
+	, "medium free"
+	, "cache alloc"
+	, "cache free"
+    };
+    vikalloc_latency_t lat;
+    unsigned path = 0;
+
+    if (NULL == stream) {
+	stream = vikalloc_log_stream;
+    }
+    vikalloc_latency_get(&lat);
+    fprintf(stream, "Latency (ns)\n  %-18s\t%10s\t%8s\t%8s\t%8s\t%8s\n"
+	    , "path", "calls", "p50", "p99", "p999", "max");
+    for (path = 0; path < VIK_PATH_COUNT; path++) {
+	if (0 == lat.count[path]) {
+	    continue;
+	}
+	fprintf(stream, "  %-18s\t%10lu\t%8.0f\t%8.0f\t%8.0f\t%8.0f\n"
+		, names[path], (unsigned long) lat.count[path]
+		, latency_percentile(&lat, path, 0.5)
+		, latency_percentile(&lat, path, 0.99)
+		, latency_percentile(&lat, path, 0.999)
+		, lat.max_ticks[path] * lat.ns_per_tick);
+    }
+}
+
+static void * vikalloc_block(size_t size)
+{
+    heap_block_t * curr = NULL;
+    heap_block_t * free_prev = NULL;
+    heap_block_t * free_next = NULL;
+    size_t size_to_request = 0;
+    size_t bytes_to_request = 0;
+    void * data_block = NULL;
+    heap_block_t * new_heap_node = NULL;
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, ">> %d: %s entry: size = %lu\n"
+		, __LINE__, __FUNCTION__, size);
+    }
+
+
+    if (0 == size) {
+	return NULL;
+    }
+
+    if(cur_heap->low_water_mark == NULL) {
+	cur_heap->low_water_mark = heap_top();
+    }
+
+    // There will always be at least 1 block requested
+    // Here we take advantage of integer division to determine the number
+    // of additional blocks needed
+    size_to_request = ((size + BLOCK_SIZE) / cur_heap->min_sbrk_size);
+    if((size + BLOCK_SIZE) % cur_heap->min_sbrk_size != 0) {
+	size_to_request++;
+    }
+    bytes_to_request = size_to_request * cur_heap->min_sbrk_size;
+    if (cur_heap->use_huge_pages) {
+	// Grow by whole huge pages so the heap never ends part way into one.
+	bytes_to_request = (bytes_to_request + HUGE_PAGE_SIZE - 1)
+	    & ~((size_t) HUGE_PAGE_SIZE - 1);
+    }
+
+
+    // Check if our data structure is NULL and initialize it if so
+    // This will involve a system call to sbrk()
+    if(cur_heap->block_list_head == NULL) {
+	new_heap_node = heap_more(bytes_to_request);
+	if(new_heap_node == (void *)-1) {
+	    if(IS_VERBOSE) {
+		fprintf(vikalloc_log_stream, "<< %d: %s sbrk failure", __LINE__, __FUNCTION__);
+	    }
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	cur_heap->block_list_head = new_heap_node;
+	cur_heap->block_list_head->capacity = bytes_to_request - BLOCK_SIZE;
+	cur_heap->block_list_head->size = size;
+	cur_heap->next_fit = cur_heap->block_list_head;
+	cur_heap->block_list_tail = cur_heap->block_list_head;
+	cur_heap->block_list_head->next = NULL;
+	cur_heap->block_list_head->prev = NULL;
+	if (IS_AVAIL(cur_heap->block_list_head)) {
+	    free_list_insert(cur_heap->block_list_head);
+	}
+	cur_heap->high_water_mark = heap_top();
+	last_path = VIK_PATH_GROW;
+	return BLOCK_DATA(cur_heap->next_fit);
+    }
+
+    // Search the free list to see if there is enough memory already we
+    // can use, starting where the last search left off.
+    // If there is a spot that already exists that can fufill our request we
+    // need to perform a split
+    if (FIRST_FIT == FIT_ALGORITHM) {
+	curr = first_fit_search(size + BLOCK_SIZE);
+    } else {
+	curr = free_list_search(size + BLOCK_SIZE);
+    }
+    if (curr != NULL) {
+	// There exists an already freed heap node, so we can use this
+	// without needing to split
+	if(IS_FREE(curr)) {
+	    curr->size = size;
+	    cur_heap->next_fit = curr;
+	    if (IS_AVAIL(curr)) {
+		free_list_update(curr, TRUE);
+		cur_heap->free_list_rover = curr;
+	    } else {
+		cur_heap->free_list_rover = free_list_remove(curr);
+	    }
+	    last_path = VIK_PATH_REUSE;
+	    return BLOCK_DATA(curr);
+	} else {
+	    // The new block is written over the end of curr, which
+	    // is where its free list links are, so take it off the
+	    // list first.
+	    free_prev = FREE_LINKS(curr)->prev_free;
+	    free_next = free_list_remove(curr);
+
+	    // perform split
+	    cur_heap->next_fit = (void *)curr + BLOCK_SIZE + CURR_SIZE(curr);
+	    cur_heap->next_fit->next = curr->next;
+	    cur_heap->next_fit->prev = curr;
+	    cur_heap->next_fit->size = size;
+	    cur_heap->next_fit->capacity = CURR_EXCESS_CAPACITY(curr) - BLOCK_SIZE;
+	    if(cur_heap->next_fit->next == NULL) { 
+		cur_heap->block_list_tail = cur_heap->next_fit;
+	    } else {
+		cur_heap->next_fit->next->prev = cur_heap->next_fit;
+	    }
+
+	    curr->capacity = CURR_SIZE(curr);
+	    curr->next = cur_heap->next_fit;
+
+	    // The new block takes the place of curr on the list.
+	    if (IS_AVAIL(cur_heap->next_fit)) {
+		free_list_insert_after(free_prev, cur_heap->next_fit);
+		cur_heap->free_list_rover = cur_heap->next_fit;
+	    } else {
+		cur_heap->free_list_rover = free_next;
+	    }
+	    last_path = VIK_PATH_SPLIT;
+	    return BLOCK_DATA(cur_heap->next_fit);
+	}
+    }
+
+    if(data_block == NULL) {
+	// wasn't a space to add our data, make a system call to sbrk to
+	// have more allocated
+	new_heap_node = heap_more(bytes_to_request);
+	if(new_heap_node == (void *)-1) {
+	    if(IS_VERBOSE) {
+		fprintf(vikalloc_log_stream, "<< %d: %s sbrk failure", __LINE__, __FUNCTION__);
+	    }
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+
+    if (data_block == NULL && cur_heap->use_region && IS_FREE(cur_heap->block_list_tail)) {
+	// The new memory starts right after a free block at the end of
+	// the heap. Grow that block instead of putting a new header in the
+	// middle of it and leaving the free block stranded.
+	curr = cur_heap->block_list_tail;
+	if (IS_AVAIL(curr)) {
+	    free_list_remove(curr);
+	}
+	curr->capacity += bytes_to_request;
+	curr->size = size;
+	if (IS_AVAIL(curr)) {
+	    free_list_insert(curr);
+	}
+	data_block = BLOCK_DATA(curr);
+    }
+
+    if(data_block == NULL) {
+	new_heap_node->next = NULL;
+	new_heap_node->prev = cur_heap->block_list_tail;
+	new_heap_node->capacity = bytes_to_request - BLOCK_SIZE;
+	new_heap_node->size = size;
+	cur_heap->block_list_tail->next = new_heap_node;
+	cur_heap->block_list_tail = new_heap_node;
+	if (IS_AVAIL(new_heap_node)) {
+	    free_list_insert(new_heap_node);
+	}
+	data_block = BLOCK_DATA(new_heap_node);
+    }
+
+    cur_heap->high_water_mark = heap_top();
+    last_path = VIK_PATH_GROW;
+
+
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "<< %d: %s exit: size = %lu\n", __LINE__, __FUNCTION__, size);
+    }
+
+    return data_block;
+}
+
+// Takes a block off the free list as part of freeing or coalescing.
+// The first block taken off remembers what came before it, since that
+// is where the coalesced block goes back on the list.
+static void free_list_pull(heap_block_t *curr, heap_block_t **free_prev
+			   , uint8_t *free_prev_known)
+{
+    if (!IS_AVAIL(curr)) {
+	return;
+    }
+    if (!*free_prev_known) {
+	*free_prev = FREE_LINKS(curr)->prev_free;
+	*free_prev_known = TRUE;
+    }
+    free_list_remove(curr);
+}
+
+static void vikfree_block(void *ptr)
+{
+    heap_block_t *curr = NULL;
+    heap_block_t *free_prev = NULL;
+    uint8_t free_prev_known = FALSE;
+
+    if (ptr == NULL) {
+	return;
+    }
+
+    // Get the data structure that holds the passed in data
+    curr = DATA_BLOCK(ptr);
+
+    if(curr == NULL) {
+	return;
+    }
+    if (IS_PARKED(curr)) {
+	// Still in a cache or on maint_pending, so this free is a second one.
+	return;
+    }
+    assert(curr->size <= curr->capacity);
+
+    if (IS_FREE(curr)) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "Block is already free: ptr = " PTR "\n"
+		    , (long) (ptr - cur_heap->low_water_mark));
+	}
+	return;
+    }
+
+    // Everything that is about to be combined comes off the free list
+    // while the capacities still say where the links are, lowest
+    // address first.
+    if (curr->prev != NULL && IS_FREE(curr->prev)) {
+	free_list_pull(curr->prev, &free_prev, &free_prev_known);
+    }
+    free_list_pull(curr, &free_prev, &free_prev_known);
+    if (curr->next != NULL && IS_FREE(curr->next)) {
+	free_list_pull(curr->next, &free_prev, &free_prev_known);
+    }
+
+    curr->size = 0;
+    cur_heap->next_fit = curr;
+    last_path = VIK_PATH_FREE;
+
+    // Check for the three scenarios which we coalesce
+    //   If curr->next and curr->prev both are of size 0
+    //   Mark curr->next->size with a dummy value we can use to stop our recursive traversal
+    //   Recursively coalesce up from curr->prev
+    //
+    //   If curr->next is of size 0
+    //   Mark curr->next->size with a dummy value we can use to stop our recursive traversal
+    //   Recursively coalesce up from curr
+    //
+    //   If curr->previous is of size 0
+    //   Mark curr->size with a dummy value we can use to stop our recursive traversal
+    //   Recursively coalesce up from curr->prev
+    if((curr->next != NULL && IS_FREE(curr->next)) && (curr->prev != NULL && IS_FREE(curr->prev))) {
+	curr->next->size = 1;
+	cur_heap->next_fit = curr->prev;
+	coalesce_up(curr->prev);
+	last_path = VIK_PATH_COALESCE;
+    } else if(curr->next != NULL && IS_FREE(curr->next)) {
+	curr->next->size = 1;
+	cur_heap->next_fit = curr;
+	coalesce_up(curr);
+	last_path = VIK_PATH_COALESCE;
+    } else if(curr->prev != NULL && IS_FREE(curr->prev)) {
+	curr->size = 1;
+	cur_heap->next_fit = curr->prev;
+	coalesce_up(curr->prev);
+	last_path = VIK_PATH_COALESCE;
+    }
+
+    // next_fit is now the coalesced block. Put it back on the free list
+    // and start the next search from it.
+    if (FREE_LIST_LIFO == FREE_LIST_ORDER) {
+	if (IS_AVAIL(cur_heap->next_fit)) {
+	    free_list_insert_after(NULL, cur_heap->next_fit);
+	    cur_heap->free_list_rover = cur_heap->next_fit;
+	}
+    } else {
+	if (!free_prev_known) {
+	    free_prev = free_list_find_prev(cur_heap->next_fit);
+	}
+	if (IS_AVAIL(cur_heap->next_fit)) {
+	    free_list_insert_after(free_prev, cur_heap->next_fit);
+	    cur_heap->free_list_rover = cur_heap->next_fit;
+	} else {
+	    cur_heap->free_list_rover = (free_prev != NULL)
+		? FREE_LINKS(free_prev)->next_free : cur_heap->free_list_head;
+	}
+    }
+
+    if (purge_advice != PURGE_NONE) {
+	purge_note_free(cur_heap->next_fit);
+    }
+    
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "<< %d: %s exit: ptr = %p\n", __LINE__, __FUNCTION__, ptr);
+    }
+}
+
+
+void coalesce_up(heap_block_t * ptr) {
+    heap_block_t * next = NULL;
+    if(ptr->size != 0) {
+	return;
+    } else {
+	coalesce_up(ptr->next);
+    }
+
+    next = ptr->next;
+    ptr->capacity += next->capacity + BLOCK_SIZE;
+    if (cur_heap->compact_cursor == next) {
+	cur_heap->compact_cursor = ptr;
+    }
+    if(next->next) {
+	next->next->prev = ptr;
+    } else {
+	cur_heap->block_list_tail = ptr;
+    }
+
+    ptr->next = next->next;
+}
+
+// The cheap half of vikfree() while the maintenance thread runs: ptr is
+// marked BLOCK_PARKED and pushed on maint_pending without taking the
+// heap lock, and the thread frees it later. Returns FALSE if ptr has to
+// be freed now, because it isn't a plain block of the default heap, is
+// already free, is too small to hold the link (the excess of a block
+// starts right after its size), or too many are pending. A block that is
+// already parked isn't pushed again, since a list that reached it twice
+// would never end.
+static uint8_t maint_defer(void *ptr)
+{
+    heap_block_t *curr = NULL;
+    size_t size = 0;
+    void *head = NULL;
+
+    if (NULL == ptr || cur_heap != &default_heap || cur_heap->checkpoint != NULL
+	|| MEDIUM_OWNS(ptr)
+	|| __atomic_load_n(&maint_pending_count, __ATOMIC_RELAXED) >= MAINT_PENDING_MAX) {
+	return FALSE;
+    }
+    curr = DATA_BLOCK(ptr);
+    size = __atomic_load_n(&curr->size, __ATOMIC_RELAXED);
+    if (size & BLOCK_PARKED) {
+	return TRUE;
+    }
+    if (size < sizeof(void *)) {
+	return FALSE;
+    }
+    if (!__atomic_compare_exchange_n(&curr->size, &size, size | BLOCK_PARKED, FALSE
+				     , __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	// Freed by another thread at the same time.
+	return TRUE;
+    }
+    __atomic_add_fetch(&maint_pending_count, 1, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&maint_pending, __ATOMIC_RELAXED);
+    do {
+	*(void **) ptr = head;
+    } while (!__atomic_compare_exchange_n(&maint_pending, &head, ptr, TRUE
+					  , __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+// Frees everything on maint_pending. Call with heap_lock held.
+static void maint_drain(void)
+{
+    void *ptr = __atomic_exchange_n(&maint_pending, NULL, __ATOMIC_ACQUIRE);
+    void *next = NULL;
+
+    for ( ; ptr != NULL; ptr = next) {
+	next = *(void **) ptr;
+	__atomic_sub_fetch(&maint_pending_count, 1, __ATOMIC_RELAXED);
+	__atomic_and_fetch(&((heap_block_t *) DATA_BLOCK(ptr))->size, ~BLOCK_PARKED
+			   , __ATOMIC_RELAXED);
+	if (profile_live != 0) {
+	    profile_forget(ptr);
+	}
+	if (LARGE_OWNS(ptr)) {
+	    large_free(ptr);
+	} else {
+	    vikfree_block(ptr);
+	}
+	maint_frees++;
+    }
+}
+
+// The small object caches. With a cache mode set, requests of up to
+// CACHE_MAX_SIZE bytes are rounded up to a size class from
+// vikalloc_size_classes.h, and freed blocks of those sizes are kept on
+// a list per size instead of going back to the heap. The lists are
+// threaded through the first bytes of the blocks, which stay in use as
+// far as the heap can tell, but are marked BLOCK_PARKED so that freeing
+// one again is ignored. Everything else goes through the heap under
+// heap_lock.
+#define CACHE_CLASS(__size) (cache_class_index[((__size) + CACHE_GRANULE - 1) / CACHE_GRANULE])
+#define CACHE_CLASS_SIZE(__cls) ((size_t) cache_class_sizes[__cls])
+
+typedef struct cache_s {
+    void *objects[CACHE_CLASSES];
+    unsigned count[CACHE_CLASSES];
+    // The watermarks. A list longer than high gives a batch to the
+    // transfer cache, and an empty one is filled to at least low. Both
+    // move with the allocs and frees seen since they were last set.
+    unsigned high[CACHE_CLASSES];
+    unsigned low[CACHE_CLASSES];
+    unsigned allocs[CACHE_CLASSES];
+    unsigned frees[CACHE_CLASSES];
+    struct cache_s *prev; // thread caches are all on a list, so
+    struct cache_s *next; // vikalloc_reset() can get to them
+    // A cache is taken with busy while a thread works on it. A thread can
+    // be moved to another CPU at any time, and the maintenance thread
+    // flushes caches nobody has touched for a while, but it is almost
+    // never contended.
+    uint8_t busy;
+    uint8_t touched;
+} cache_t;
+
+typedef struct cpu_cache_s {
+    cache_t cache;
+} __attribute__((aligned(64))) cpu_cache_t;
+
+static vikalloc_cache_mode_t cache_mode = CACHE_NONE;
+static cpu_cache_t cpu_caches[CACHE_MAX_CPUS];
+static cache_t *thread_caches = NULL;
+static pthread_key_t thread_cache_key;
+static __thread cache_t thread_cache;
+static __thread uint8_t thread_cache_ready = FALSE;
+
+// The transfer cache, where the caches trade whole batches of
+// CACHE_BATCH blocks, so a thread that only frees can feed one that only
+// allocates without either going to the heap. A batch is a list of
+// blocks, like the ones in the caches.
+typedef struct transfer_s {
+    void *batches[TRANSFER_BATCHES];
+    unsigned count;
+} transfer_t;
+
+static transfer_t transfer[CACHE_CLASSES];
+static uint8_t transfer_touched = FALSE;
+static pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The CPU the calling thread is on. glibc registers an rseq area for
+// every thread, and the kernel keeps the CPU number in it up to date,
+// so this is a load. Without rseq it is the getcpu system call.
+static unsigned current_cpu(void)
+{
+    unsigned cpu = 0;
+#ifdef HAVE_RSEQ
+    struct rseq *area = NULL;
+
+    if (__rseq_size != 0) {
+	area = (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+	cpu = __atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+	if ((int32_t) cpu >= 0) {
+	    return cpu % CACHE_MAX_CPUS;
+	}
+	cpu = 0;
+    }
+#endif // HAVE_RSEQ
+    syscall(SYS_getcpu, &cpu, NULL, NULL);
+    return cpu % CACHE_MAX_CPUS;
+}
+
+// Takes the BLOCK_PARKED mark off a block leaving the caches.
+static inline void cache_unpark(void *obj)
+{
+    __atomic_and_fetch(&((heap_block_t *) DATA_BLOCK(obj))->size, ~BLOCK_PARKED
+		       , __ATOMIC_RELAXED);
+}
+
+// Gives count objects of class cls back to the heap.
+// Call with heap_lock held.
+static void cache_flush(cache_t *cache, unsigned cls, unsigned count)
+{
+    void *obj = NULL;
+
+    while (count-- > 0 && cache->objects[cls] != NULL) {
+	obj = cache->objects[cls];
+	cache->objects[cls] = *(void **) obj;
+	cache->count[cls]--;
+	cache_unpark(obj);
+	vikfree_block(obj);
+    }
+}
+
+static void cache_flush_all(cache_t *cache)
+{
+    unsigned cls = 0;
+
+    for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	cache_flush(cache, cls, cache->count[cls]);
+    }
+}
+
+// Called when a thread with a cache exits.
+static void cache_thread_exit(void *arg)
+{
+    cache_t *cache = arg;
+
+    pthread_mutex_lock(&heap_lock);
+    cache_flush_all(cache);
+    if (cache->prev != NULL) {
+	cache->prev->next = cache->next;
+    } else {
+	thread_caches = cache->next;
+    }
+    if (cache->next != NULL) {
+	cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    thread_cache_ready = FALSE;
+}
+
+// Takes the first CACHE_BATCH blocks of class cls off cache and gives
+// them to the transfer cache, or to the heap if it is full.
+static void cache_give_batch(cache_t *cache, unsigned cls)
+{
+    void *batch = cache->objects[cls];
+    void *last = batch;
+    unsigned i = 0;
+
+    for (i = 1; i < CACHE_BATCH; i++) {
+	last = *(void **) last;
+    }
+    pthread_mutex_lock(&transfer_lock);
+    transfer_touched = TRUE;
+    if (transfer[cls].count < TRANSFER_BATCHES) {
+	cache->objects[cls] = *(void **) last;
+	cache->count[cls] -= CACHE_BATCH;
+	*(void **) last = NULL;
+	transfer[cls].batches[transfer[cls].count++] = batch;
+	batch = NULL;
+    }
+    pthread_mutex_unlock(&transfer_lock);
+    if (batch != NULL) {
+	pthread_mutex_lock(&heap_lock);
+	cache_flush(cache, cls, CACHE_BATCH);
+	pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+// Fills an empty list of class cls from the transfer cache, up to the
+// low watermark. Returns FALSE if the transfer cache had nothing.
+static uint8_t cache_take_batches(cache_t *cache, unsigned cls)
+{
+    void *batch = NULL;
+    void *last = NULL;
+
+    pthread_mutex_lock(&transfer_lock);
+    transfer_touched = TRUE;
+    while (transfer[cls].count > 0 && cache->count[cls] < cache->low[cls]) {
+	batch = transfer[cls].batches[--transfer[cls].count];
+	for (last = batch; *(void **) last != NULL; last = *(void **) last) {
+	}
+	*(void **) last = cache->objects[cls];
+	cache->objects[cls] = batch;
+	cache->count[cls] += CACHE_BATCH;
+    }
+    pthread_mutex_unlock(&transfer_lock);
+    return cache->count[cls] > 0;
+}
+
+// Moves the watermarks of class cls after the list ran over (overflow)
+// or out. A thread that mostly frees has no use for a long list, so its
+// high watermark drops and batches go to the transfer cache sooner. One
+// that mostly allocates takes more batches at a time. One that does both
+// about equally gets more room, since it is trading with itself.
+static void cache_adapt(cache_t *cache, unsigned cls, uint8_t overflow)
+{
+    unsigned allocs = cache->allocs[cls];
+    unsigned frees = cache->frees[cls];
+
+    if (overflow) {
+	if (frees > 2 * allocs) {
+	    cache->high[cls] = MAX(2 * CACHE_BATCH, cache->high[cls] / 2);
+	} else {
+	    cache->high[cls] = MIN(CACHE_CLASS_MAX, cache->high[cls] * 2);
+	}
+    } else {
+	if (allocs > 2 * frees) {
+	    cache->low[cls] = MIN(cache->high[cls], cache->low[cls] * 2);
+	} else {
+	    cache->low[cls] = CACHE_BATCH;
+	}
+    }
+    cache->allocs[cls] = 0;
+    cache->frees[cls] = 0;
+}
+
+static void cache_init(cache_t *cache)
+{
+    unsigned cls = 0;
+
+    memset(cache->objects, 0, sizeof(cache->objects));
+    memset(cache->count, 0, sizeof(cache->count));
+    memset(cache->allocs, 0, sizeof(cache->allocs));
+    memset(cache->frees, 0, sizeof(cache->frees));
+    for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	cache->high[cls] = 2 * CACHE_BATCH;
+	cache->low[cls] = CACHE_BATCH;
+    }
+}
+
+// Returns the cache for the calling thread to use, which must be given
+// back with cache_put().
+static cache_t *cache_get(void)
+{
+    cache_t *cache = NULL;
+
+    if (CACHE_THREAD == cache_mode) {
+	if (!thread_cache_ready) {
+	    memset(&thread_cache, 0, sizeof(thread_cache));
+	    cache_init(&thread_cache);
+	    pthread_mutex_lock(&heap_lock);
+	    thread_cache.next = thread_caches;
+	    if (thread_caches != NULL) {
+		thread_caches->prev = &thread_cache;
+	    }
+	    thread_caches = &thread_cache;
+	    pthread_mutex_unlock(&heap_lock);
+	    pthread_setspecific(thread_cache_key, &thread_cache);
+	    thread_cache_ready = TRUE;
+	}
+	cache = &thread_cache;
+    } else {
+	cache = &cpu_caches[current_cpu()].cache;
+    }
+    while (__atomic_test_and_set(&cache->busy, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+    cache->touched = TRUE;
+    return cache;
+}
+
+static void cache_put(cache_t *cache)
+{
+    __atomic_clear(&cache->busy, __ATOMIC_RELEASE);
+}
+
+// The small object path of vikalloc(). An empty list is filled from the
+// transfer cache, or else with CACHE_BATCH blocks from the heap at once,
+// so the heap lock is only taken once for all of them.
+static void *cache_alloc(size_t size)
+{
+    unsigned cls = CACHE_CLASS(size);
+    cache_t *cache = cache_get();
+    void *obj = cache->objects[cls];
+    unsigned i = 0;
+
+    cache->allocs[cls]++;
+    if (NULL == obj) {
+	cache_adapt(cache, cls, FALSE);
+	if (cache_take_batches(cache, cls)) {
+	    obj = cache->objects[cls];
+	    cache->objects[cls] = *(void **) obj;
+	    cache->count[cls]--;
+	    cache_put(cache);
+	    cache_unpark(obj);
+	    return obj;
+	}
+	pthread_mutex_lock(&heap_lock);
+	for (i = 0; i < CACHE_BATCH; i++) {
+	    obj = vikalloc_block(CACHE_CLASS_SIZE(cls));
+	    if (NULL == obj) {
+		break;
+	    }
+	    *(void **) obj = cache->objects[cls];
+	    cache->objects[cls] = obj;
+	    cache->count[cls]++;
+	}
+	pthread_mutex_unlock(&heap_lock);
+	obj = cache->objects[cls];
+	if (NULL == obj) {
+	    cache_put(cache);
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+    cache->objects[cls] = *(void **) obj;
+    cache->count[cls]--;
+    cache_put(cache);
+    cache_unpark(obj);
+    return obj;
+}
+
+// The small object path of vikfree(). Returns FALSE if ptr isn't a
+// block the caches can take. A block that is already parked, in a cache
+// or on maint_pending, is being freed twice and is left where it is. A
+// list that gets longer than its high watermark gives a batch to the
+// transfer cache.
+static uint8_t cache_free(void *ptr)
+{
+    heap_block_t *curr = NULL;
+    size_t size = 0;
+    unsigned cls = 0;
+    cache_t *cache = NULL;
+
+    if (NULL == ptr || cur_heap != &default_heap || cur_heap->checkpoint != NULL
+	|| MEDIUM_OWNS(ptr)) {
+	return FALSE;
+    }
+    curr = DATA_BLOCK(ptr);
+    size = __atomic_load_n(&curr->size, __ATOMIC_RELAXED);
+    if (size & BLOCK_PARKED) {
+	return TRUE;
+    }
+    if (0 == size || size > CACHE_MAX_SIZE || size != CACHE_CLASS_SIZE(CACHE_CLASS(size))) {
+	return FALSE;
+    }
+    if (!__atomic_compare_exchange_n(&curr->size, &size, size | BLOCK_PARKED, FALSE
+				     , __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	// Freed by another thread at the same time.
+	return TRUE;
+    }
+    cls = CACHE_CLASS(size);
+    cache = cache_get();
+    *(void **) ptr = cache->objects[cls];
+    cache->objects[cls] = ptr;
+    cache->frees[cls]++;
+    if (++cache->count[cls] > cache->high[cls]) {
+	cache_adapt(cache, cls, TRUE);
+	while (cache->count[cls] > cache->high[cls]) {
+	    cache_give_batch(cache, cls);
+	}
+    }
+    cache_put(cache);
+    return TRUE;
+}
+
+// Empties every cache and the transfer cache. With release, the blocks
+// go back to the heap, otherwise they are just forgotten. Call with
+// heap_lock held.
+static void cache_clear(uint8_t release)
+{
+    cache_t *cache = NULL;
+    unsigned cpu = 0;
+    unsigned cls = 0;
+    void *obj = NULL;
+
+    for (cache = thread_caches; cache != NULL; cache = cache->next) {
+	if (release) {
+	    cache_flush_all(cache);
+	}
+	cache_init(cache);
+    }
+    for (cpu = 0; cpu < CACHE_MAX_CPUS; cpu++) {
+	if (release) {
+	    cache_flush_all(&cpu_caches[cpu].cache);
+	}
+	cache_init(&cpu_caches[cpu].cache);
+    }
+    pthread_mutex_lock(&transfer_lock);
+    for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	while (transfer[cls].count > 0) {
+	    obj = transfer[cls].batches[--transfer[cls].count];
+	    while (release && obj != NULL) {
+		void *next = *(void **) obj;
+
+		cache_unpark(obj);
+		vikfree_block(obj);
+		obj = next;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&transfer_lock);
+}
+
+// Bytes of blocks sitting in the caches.
+static size_t cache_total(void)
+{
+    cache_t *cache = NULL;
+    unsigned cpu = 0;
+    unsigned cls = 0;
+    size_t bytes = 0;
+
+    for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	for (cache = thread_caches; cache != NULL; cache = cache->next) {
+	    bytes += cache->count[cls] * CACHE_CLASS_SIZE(cls);
+	}
+	for (cpu = 0; cpu < CACHE_MAX_CPUS; cpu++) {
+	    bytes += cpu_caches[cpu].cache.count[cls] * CACHE_CLASS_SIZE(cls);
+	}
+    }
+    return bytes;
+}
+
+// Bytes of blocks sitting in the transfer cache.
+static size_t transfer_total(void)
+{
+    unsigned cls = 0;
+    size_t bytes = 0;
+
+    pthread_mutex_lock(&transfer_lock);
+    for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	bytes += transfer[cls].count * CACHE_BATCH * CACHE_CLASS_SIZE(cls);
+    }
+    pthread_mutex_unlock(&transfer_lock);
+    return bytes;
+}
+
+vikalloc_cache_mode_t vikalloc_set_cache_mode(vikalloc_cache_mode_t mode)
+{
+    static uint8_t key_ready = FALSE;
+
+    if (mode == cache_mode) {
+	return cache_mode;
+    }
+    heap_lock_init();
+    if (!key_ready) {
+	pthread_key_create(&thread_cache_key, cache_thread_exit);
+	key_ready = TRUE;
+    }
+    pthread_mutex_lock(&heap_lock);
+    cache_clear(TRUE);
+    cache_mode = mode;
+    __atomic_store_n(&heap_locking, cache_mode != CACHE_NONE || maint_running, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap_lock);
+    return cache_mode;
+}
+
+// Puts off freeing a block from before the innermost checkpoint until
+// the checkpoint is committed.
+static void checkpoint_defer(void *ptr)
+{
+    deferred_free_t *deferred = vikalloc_block(sizeof(deferred_free_t));
+
+    if (NULL == deferred) {
+	// Out of memory. The block stays allocated until a reset.
+	return;
+    }
+    deferred->ptr = ptr;
+    deferred->next = cur_heap->checkpoint->deferred;
+    cur_heap->checkpoint->deferred = deferred;
+}
+
+// Counts an allocation towards the next sample. Call with heap_lock
+// held. Always inlined, so profile_record() is still called straight
+// from vikalloc() or vikrealloc().
+static inline void profile_sample(void *ptr, size_t size) __attribute__((always_inline));
+static inline void profile_sample(void *ptr, size_t size)
+{
+    if (sample_rate != 0 && ptr != NULL) {
+	sample_countdown -= size;
+	if (sample_countdown <= 0) {
+	    sample_countdown = profile_next_countdown();
+	    profile_record(ptr, size);
+	}
+    }
+}
+
+// vikalloc() past the caches and without the timing, for calls made
+// while another one is timed. Call with heap_lock held.
+static inline void *vikalloc_locked(size_t size) __attribute__((always_inline));
+static inline void *vikalloc_locked(size_t size)
+{
+    void *ptr = NULL;
+
+    if (large_min_size != 0 && size >= large_min_size
+	&& cur_heap == &default_heap && NULL == cur_heap->checkpoint) {
+	ptr = large_alloc(size);
+    } else if (use_medium && size >= MEDIUM_MIN_SIZE && size <= MEDIUM_MAX_SIZE
+	       && cur_heap == &default_heap && NULL == cur_heap->checkpoint) {
+	ptr = medium_alloc(size);
+    } else {
+	ptr = vikalloc_block(size);
+    }
+    profile_sample(ptr, size);
+    return ptr;
+}
+
+// vikfree() past the caches and without the timing. Call with
+// heap_lock held.
+static void vikfree_locked(void *ptr)
+{
+    if (profile_live != 0 && ptr != NULL) {
+	profile_forget(ptr);
+    }
+    if (CHECKPOINT_OLDER(ptr)) {
+	checkpoint_defer(ptr);
+    } else if (MEDIUM_OWNS(ptr)) {
+	medium_free(ptr);
+    } else if (ptr != NULL && LARGE_OWNS(ptr)) {
+	large_free(ptr);
+    } else {
+	vikfree_block(ptr);
+    }
+}
+
+void * vikalloc(size_t size)
+{
+    uint64_t start = 0;
+    uint64_t ticks = 0;
+    void *ptr = NULL;
+    uint8_t locked = FALSE;
+
+    if (size_histogram_on && size != 0) {
+	// Relaxed, since the cache path below doesn't hold the heap lock.
+	__atomic_add_fetch(&size_histogram[MIN((size + SIZE_HISTOGRAM_GRANULE - 1)
+					       / SIZE_HISTOGRAM_GRANULE
+					       , SIZE_HISTOGRAM_BUCKETS - 1)]
+			   , 1, __ATOMIC_RELAXED);
+    }
+    if (cache_mode != CACHE_NONE && size != 0 && size <= CACHE_MAX_SIZE
+	&& cur_heap == &default_heap && NULL == cur_heap->checkpoint) {
+	if (0 == sample_rate && !latency_tracking) {
+	    return cache_alloc(size);
+	}
+	// The profiler and the latency histograms are kept under the heap
+	// lock, which the cache doesn't take, so it is taken afterwards
+	// and left out of the time.
+	if (latency_tracking) {
+	    start = latency_ticks();
+	}
+	ptr = cache_alloc(size);
+	if (latency_tracking) {
+	    ticks = latency_ticks() - start;
+	}
+	locked = heap_lock_take();
+	if (latency_tracking) {
+	    start = latency_ticks() - ticks;
+	}
+	last_path = VIK_PATH_CACHE;
+	profile_sample(ptr, size);
+    } else {
+	locked = heap_lock_take();
+	if (latency_tracking) {
+	    start = latency_ticks();
+	}
+	ptr = vikalloc_locked(size);
+    }
+    if (latency_tracking && ptr != NULL) {
+	latency_record(last_path, start);
+    }
+    heap_lock_drop(locked);
+    return ptr;
+}
+
+void vikfree(void *ptr)
+{
+    uint64_t start = 0;
+    uint64_t ticks = 0;
+    uint8_t locked = FALSE;
+
+    if (cache_mode != CACHE_NONE) {
+	// A sample is forgotten before the cache can hand the block to
+	// another thread, which might be sampled in its turn.
+	if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0 && ptr != NULL) {
+	    locked = heap_lock_take();
+	    profile_forget(ptr);
+	    heap_lock_drop(locked);
+	}
+	if (latency_tracking) {
+	    start = latency_ticks();
+	}
+	if (cache_free(ptr)) {
+	    if (latency_tracking) {
+		ticks = latency_ticks() - start;
+		locked = heap_lock_take();
+		last_path = VIK_PATH_CACHE_FREE;
+		latency_record(last_path, latency_ticks() - ticks);
+		heap_lock_drop(locked);
+	    }
+	    return;
+	}
+    }
+    if (maint_running && maint_defer(ptr)) {
+	return;
+    }
+    locked = heap_lock_take();
+    if (latency_tracking) {
+	start = latency_ticks();
+    }
+    vikfree_locked(ptr);
+    if (latency_tracking && ptr != NULL) {
+	latency_record(last_path, start);
+    }
+    heap_lock_drop(locked);
+}
+
+
+///////////////
+
+// Makes all of a buffer heap into one free block. The heap never grows,
+// so vikalloc() finds everything it can use on the free list.
+static void buffer_format(void)
+{
+    heap_block_t *curr = cur_heap->region_base;
+
+    curr->capacity = (cur_heap->region_end - cur_heap->region_base) - BLOCK_SIZE;
+    curr->size = 0;
+    curr->next = NULL;
+    curr->prev = NULL;
+    cur_heap->block_list_head = curr;
+    cur_heap->block_list_tail = curr;
+    cur_heap->next_fit = curr;
+    cur_heap->region_brk = cur_heap->region_end;
+    cur_heap->high_water_mark = cur_heap->region_end;
+    free_list_insert(curr);
+}
+
+// Drops everything done to cur_heap since the innermost checkpoint.
+static void heap_rollback(void)
+{
+    checkpoint_t *checkpoint = cur_heap->checkpoint;
+    void *mark = cur_heap->low_water_mark;
+    void *top = heap_top();
+    size_t i = 0;
+
+    *cur_heap = checkpoint->saved;
+    if (cur_heap->use_region) {
+	mmap(mark, top - mark, PROT_NONE
+	     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    } else {
+	brk(mark);
+    }
+
+    // Samples of the dropped blocks aren't live any more.
+    if (profile_live != 0) {
+	for (i = 0; i < PROFILE_RING_SIZE; i++) {
+	    if (profile_ring[i].live && profile_ring[i].ptr >= mark && profile_ring[i].ptr < top) {
+		profile_forget(profile_ring[i].ptr);
+	    }
+	}
+    }
+}
+
+// Gives back all of the memory of cur_heap.
+static void heap_reset(void)
+{
+    while (cur_heap->checkpoint != NULL) {
+	heap_rollback();
+    }
+    if (cur_heap->low_water_mark != NULL) {
+	if (IS_VERBOSE) {
+	    fprintf(vikalloc_log_stream, "*** Resetting all vikalloc space ***\n");
+	}
+
+	if (cur_heap->use_region) {
+	    region_release();
+	} else {
+	    brk(cur_heap->low_water_mark);
+	}
+	cur_heap->high_water_mark = cur_heap->low_water_mark;
+
+	cur_heap->block_list_head = NULL;
+	cur_heap->block_list_tail = NULL;
+	cur_heap->next_fit = NULL;
+
+	cur_heap->free_list_head = NULL;
+	cur_heap->free_list_tail = NULL;
+	cur_heap->free_list_rover = NULL;
+	side_table_reset();
+	treap_reset();
+	cur_heap->handles_used = 0;
+	cur_heap->handle_free = NULL;
+	cur_heap->compact_cursor = NULL;
+	if (cur_heap->fixed) {
+	    buffer_format();
+	}
+    }
+}
+
+void vikalloc_reset(void)
+{
+    size_t i = 0;
+    uint8_t locked = heap_lock_take();
+
+    if (locked) {
+	cache_clear(FALSE);
+    }
+    // Pending frees are of blocks that are about to go anyway.
+    __atomic_store_n(&maint_pending, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&maint_pending_count, 0, __ATOMIC_RELAXED);
+    medium_release();
+    large_release();
+    if (cur_heap->low_water_mark != NULL) {
+	heap_reset();
+
+	// Samples that were still live point into the heap that is gone.
+	if (profile_live != 0) {
+	    for (i = 0; i < PROFILE_RING_SIZE; i++) {
+		profile_ring[i].live = FALSE;
+	    }
+	    memset(profile_index, 0, sizeof(profile_index));
+	    __atomic_store_n(&profile_live, 0, __ATOMIC_RELAXED);
+	}
+    }
+    heap_lock_drop(locked);
+}
+
+static int heap_checkpoint(void)
+{
+    vikheap_t saved;
+    checkpoint_t *checkpoint = NULL;
+
+    // Pending frees would be of blocks from before the checkpoint.
+    maint_drain();
+    saved = *cur_heap;
+    if (cur_heap->fixed) {
+	// There is no top to start a new heap at.
+	errno = EINVAL;
+	return -1;
+    }
+
+    // Start an empty heap at the top of this one. It grows from there
+    // the same way the first vikalloc() of a new heap does.
+    cur_heap->low_water_mark = heap_top();
+    cur_heap->high_water_mark = cur_heap->low_water_mark;
+    cur_heap->block_list_head = NULL;
+    cur_heap->block_list_tail = NULL;
+    cur_heap->next_fit = NULL;
+    cur_heap->free_list_head = NULL;
+    cur_heap->free_list_tail = NULL;
+    cur_heap->free_list_rover = NULL;
+    // Entries on the side table's free chain have to stay on it in case
+    // of a rollback, so the new heap only takes ones never used before.
+    cur_heap->side_table_free = NULL;
+    cur_heap->side_head = NULL;
+    cur_heap->compact_cursor = NULL;
+    cur_heap->treap_free = NULL;
+    cur_heap->treap_root = NULL;
+
+    checkpoint = vikalloc_block(sizeof(checkpoint_t));
+    if (NULL == checkpoint) {
+	*cur_heap = saved;
+	return -1;
+    }
+    checkpoint->saved = saved;
+    checkpoint->deferred = NULL;
+    cur_heap->checkpoint = checkpoint;
+    return 0;
+}
+
+int vikalloc_checkpoint(void)
+{
+    uint8_t locked = heap_lock_take();
+    int ret = heap_checkpoint();
+
+    heap_lock_drop(locked);
+    return ret;
+}
+
+int vikalloc_rollback(void)
+{
+    uint8_t locked = FALSE;
+
+    if (NULL == cur_heap->checkpoint) {
+	errno = EINVAL;
+	return -1;
+    }
+    locked = heap_lock_take();
+    heap_rollback();
+    heap_lock_drop(locked);
+    return 0;
+}
+
+static int heap_commit(void)
+{
+    checkpoint_t *checkpoint = cur_heap->checkpoint;
+    vikheap_t *outer = NULL;
+    deferred_free_t *deferred = NULL;
+    deferred_free_t *next = NULL;
+    side_entry_t *entry = NULL;
+    treap_node_t *node = NULL;
+
+    if (NULL == checkpoint) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    // Put the new blocks, and their free list, on the end of the old
+    // ones. The old free blocks are all at lower addresses, so the
+    // joined list is still in address order.
+    outer = &checkpoint->saved;
+    cur_heap->checkpoint = outer->checkpoint;
+    if (outer->block_list_head != NULL) {
+	outer->block_list_tail->next = cur_heap->block_list_head;
+	cur_heap->block_list_head->prev = outer->block_list_tail;
+	cur_heap->block_list_head = outer->block_list_head;
+	cur_heap->low_water_mark = outer->low_water_mark;
+    }
+    if (outer->free_list_head != NULL) {
+	if (cur_heap->free_list_head != NULL) {
+	    FREE_LINKS(outer->free_list_tail)->next_free = cur_heap->free_list_head;
+	    FREE_LINKS(outer->free_list_tail)->next_capacity = cur_heap->free_list_head->capacity;
+	    FREE_LINKS(cur_heap->free_list_head)->prev_free = outer->free_list_tail;
+	    if (cur_heap->use_side_table) {
+		SIDE_ENTRY(outer->free_list_tail)->next_entry = cur_heap->side_head;
+	    }
+	} else {
+	    cur_heap->free_list_tail = outer->free_list_tail;
+	}
+	cur_heap->free_list_head = outer->free_list_head;
+	cur_heap->side_head = outer->side_head;
+	cur_heap->miss_bound = (0 == outer->miss_bound || 0 == cur_heap->miss_bound)
+	    ? 0 : MAX(outer->miss_bound, cur_heap->miss_bound);
+	cur_heap->treap_root = treap_merge(outer->treap_root, cur_heap->treap_root);
+    }
+    // The checkpoint set the free side table entries and treap nodes of
+    // the outer heap aside, for a rollback. They are free again now.
+    if (cur_heap->use_side_table && outer->side_table_free != NULL) {
+	for (entry = outer->side_table_free; entry->next_entry != NULL; entry = entry->next_entry) {
+	}
+	entry->next_entry = cur_heap->side_table_free;
+	cur_heap->side_table_free = outer->side_table_free;
+    }
+    if (cur_heap->use_treap && outer->treap_free != NULL) {
+	for (node = outer->treap_free; node->left != NULL; node = node->left) {
+	}
+	node->left = cur_heap->treap_free;
+	cur_heap->treap_free = outer->treap_free;
+    }
+    deferred = checkpoint->deferred;
+    vikfree_block(checkpoint);
+
+    // Now do the frees that were put off, on this heap and past the
+    // caches and the maintenance thread. If there is still a checkpoint
+    // open, the ones from before it are put off again.
+    for ( ; deferred != NULL; deferred = next) {
+	next = deferred->next;
+	vikfree_locked(deferred->ptr);
+	vikfree_block(deferred);
+    }
+    return 0;
+}
+
+int vikalloc_commit(void)
+{
+    uint8_t locked = heap_lock_take();
+    int ret = heap_commit();
+
+    heap_lock_drop(locked);
+    return ret;
+}
+
+// What stream_zero() and stream_copy() can use, from CPUID. Found the
+// first time they are needed.
+typedef enum {
+    STREAM_UNKNOWN = 0
+    , STREAM_NONE
+    , STREAM_SSE2
+    , STREAM_AVX2
+} stream_level_t;
+
+static stream_level_t stream_level = STREAM_UNKNOWN;
+
+static stream_level_t stream_detect(void)
+{
+    stream_level_t level = __atomic_load_n(&stream_level, __ATOMIC_RELAXED);
+
+    if (level != STREAM_UNKNOWN) {
+	return level;
+    }
+    level = STREAM_NONE;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	level = STREAM_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+	level = STREAM_SSE2;
+    }
+#endif
+    if (IS_VERBOSE) {
+	fprintf(vikalloc_log_stream, "** Streaming stores: %s\n"
+		, (STREAM_AVX2 == level) ? "AVX2"
+		: (STREAM_SSE2 == level) ? "SSE2" : "none");
+    }
+    __atomic_store_n(&stream_level, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The loops below take dst aligned to the vector size and len a
+// multiple of 128, and leave the sfence to the caller.
+
+__attribute__((target("avx2")))
+static void stream_zero_avx2(char *dst, size_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+
+    for ( ; len != 0; len -= 128, dst += 128) {
+	_mm256_stream_si256((__m256i *) dst, zero);
+	_mm256_stream_si256((__m256i *) (dst + 32), zero);
+	_mm256_stream_si256((__m256i *) (dst + 64), zero);
+	_mm256_stream_si256((__m256i *) (dst + 96), zero);
+    }
+}
+
+__attribute__((target("avx2")))
+static void stream_copy_avx2(char *dst, const char *src, size_t len)
+{
+    for ( ; len != 0; len -= 128, dst += 128, src += 128) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) src);
+	__m256i b = _mm256_loadu_si256((const __m256i *) (src + 32));
+	__m256i c = _mm256_loadu_si256((const __m256i *) (src + 64));
+	__m256i d = _mm256_loadu_si256((const __m256i *) (src + 96));
+
+	_mm256_stream_si256((__m256i *) dst, a);
+	_mm256_stream_si256((__m256i *) (dst + 32), b);
+	_mm256_stream_si256((__m256i *) (dst + 64), c);
+	_mm256_stream_si256((__m256i *) (dst + 96), d);
+    }
+}
+
+__attribute__((target("sse2")))
+static void stream_zero_sse2(char *dst, size_t len)
+{
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for ( ; len != 0; len -= 128, dst += 128) {
+	for (i = 0; i < 128; i += 16) {
+	    _mm_stream_si128((__m128i *) (dst + i), zero);
+	}
+    }
+}
+
+__attribute__((target("sse2")))
+static void stream_copy_sse2(char *dst, const char *src, size_t len)
+{
+    size_t i = 0;
+
+    for ( ; len != 0; len -= 128, dst += 128, src += 128) {
+	for (i = 0; i < 128; i += 16) {
+	    _mm_stream_si128((__m128i *) (dst + i)
+			     , _mm_loadu_si128((const __m128i *) (src + i)));
+	}
+    }
+}
+#endif
+
+// Zeroes len bytes at dst. A large buffer is written around the caches,
+// so clearing it doesn't evict everything else the program was using.
+static void stream_zero(void *dst, size_t len)
+{
+    stream_level_t level = STREAM_NONE;
+    size_t head = 0;
+    size_t body = 0;
+
+    // Under 256 bytes there may be no aligned middle at all.
+    if (0 == stream_min_size || len < MAX(stream_min_size, 256)) {
+	memset(dst, 0, len);
+	return;
+    }
+    level = stream_detect();
+    if (STREAM_NONE == level) {
+	memset(dst, 0, len);
+	return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    // The ends go through the cache, the aligned middle doesn't.
+    head = (-(uintptr_t) dst) & 31;
+    body = (len - head) & ~(size_t) 127;
+    memset(dst, 0, head);
+    if (STREAM_AVX2 == level) {
+	stream_zero_avx2((char *) dst + head, body);
+    } else {
+	stream_zero_sse2((char *) dst + head, body);
+    }
+    _mm_sfence();
+    memset((char *) dst + head + body, 0, len - head - body);
+    __atomic_fetch_add(&streamed_bytes, body, __ATOMIC_RELAXED);
+#endif
+}
+
+// Copies len bytes from src to dst, which must not overlap, the same
+// way as stream_zero().
+static void stream_copy(void *dst, const void *src, size_t len)
+{
+    stream_level_t level = STREAM_NONE;
+    size_t head = 0;
+    size_t body = 0;
+
+    if (0 == stream_min_size || len < MAX(stream_min_size, 256)) {
+	memcpy(dst, src, len);
+	return;
+    }
+    level = stream_detect();
+    if (STREAM_NONE == level) {
+	memcpy(dst, src, len);
+	return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    head = (-(uintptr_t) dst) & 31;
+    body = (len - head) & ~(size_t) 127;
+    memcpy(dst, src, head);
+    if (STREAM_AVX2 == level) {
+	stream_copy_avx2((char *) dst + head, (const char *) src + head, body);
+    } else {
+	stream_copy_sse2((char *) dst + head, (const char *) src + head, body);
+    }
+    _mm_sfence();
+    memcpy((char *) dst + head + body, (const char *) src + head + body
+	   , len - head - body);
+    __atomic_fetch_add(&streamed_bytes, body, __ATOMIC_RELAXED);
+#endif
+}
+
+void vikalloc_set_stream_min(size_t min_size)
+{
+    stream_min_size = min_size;
+}
+
+void * vikcalloc(size_t nmemb, size_t size)
+{
+    void *ptr = vikalloc(nmemb * size);
+    if(ptr == NULL) {
+	return NULL;
+    }
+
+    // A large object is new pages, which are zero already.
+    if (MEDIUM_OWNS(ptr) || !LARGE_OWNS(ptr)) {
+	stream_zero(ptr, nmemb * size);
+    }
+    return ptr;
+}
+
+// Shrinks curr to size bytes and makes everything after them a block of
+// its own, which is then freed like any other, so it coalesces with a
+// free block after it and can be purged or trimmed.
+static void release_tail(heap_block_t *curr, size_t size)
+{
+    heap_block_t *tail = NULL;
+
+    // The links are found from the capacity, so they come off first.
+    if (IS_AVAIL(curr)) {
+	free_list_remove(curr);
+    }
+    tail = (heap_block_t *) (BLOCK_DATA(curr) + size);
+    tail->capacity = curr->capacity - size - BLOCK_SIZE;
+    // In use and full, like a block that was never on the free list.
+    tail->size = tail->capacity;
+    tail->prev = curr;
+    tail->next = curr->next;
+    if (tail->next != NULL) {
+	tail->next->prev = tail;
+    } else {
+	cur_heap->block_list_tail = tail;
+    }
+    curr->next = tail;
+    curr->capacity = size;
+    curr->size = size;
+    vikfree_block(BLOCK_DATA(tail));
+}
+
+// An object from before a checkpoint is always moved, so that a
+// rollback gets it back as it was.
+static void * vikrealloc_block(void *ptr, size_t size)
+{
+    heap_block_t *curr = NULL;
+    void * new_heap_node = NULL;
+    uint8_t was_avail = FALSE;
+    size_t old_size = 0;
+
+    if(ptr == NULL) {
+	return vikalloc_locked(size);
     }
 
     if(0 == size) {
-	vikfree(ptr);
+	vikfree_locked(ptr);
+	return NULL;
+    }
+
+    if (MEDIUM_OWNS(ptr)) {
+	// Stay in the slot if it still fits and isn't mostly wasted.
+	old_size = medium_usable(ptr);
+	if (size <= old_size && size > old_size / 2 && !CHECKPOINT_OLDER(ptr)) {
+	    last_path = VIK_PATH_REALLOC_INPLACE;
+	    return ptr;
+	}
+	new_heap_node = vikalloc_locked(size);
+	if(new_heap_node == NULL) {
+	    return NULL;
+	}
+	memcpy(new_heap_node, ptr, MIN(size, old_size));
+	vikfree_locked(ptr);
+	last_path = VIK_PATH_REALLOC_MOVE;
+	return new_heap_node;
+    }
+
+    if (LARGE_OWNS(ptr)) {
+	// It goes back to the heap once it is well under the threshold.
+	if (!CHECKPOINT_OLDER(ptr) && (0 == large_min_size || size >= large_min_size / 2)) {
+	    new_heap_node = large_remap(ptr, size);
+	    if (new_heap_node != NULL && new_heap_node != ptr && profile_live != 0) {
+		profile_forget(ptr);
+	    }
+	    return new_heap_node;
+	}
+	old_size = ((heap_block_t *) DATA_BLOCK(ptr))->size;
+	new_heap_node = vikalloc_locked(size);
+	if(new_heap_node == NULL) {
+	    return NULL;
+	}
+	stream_copy(new_heap_node, ptr, MIN(size, old_size));
+	vikfree_locked(ptr);
+	last_path = VIK_PATH_REALLOC_MOVE;
+	return new_heap_node;
+    }
+
+    curr = DATA_BLOCK(ptr);
+    if(size <= curr->capacity && !CHECKPOINT_OLDER(ptr)) {
+	if (size < curr->size && curr->capacity - size >= BLOCK_SIZE + REALLOC_SPLIT_MIN) {
+	    release_tail(curr, size);
+	} else {
+	    was_avail = IS_AVAIL(curr);
+	    curr->size = size;
+	    free_list_update(curr, was_avail);
+	}
+	last_path = VIK_PATH_REALLOC_INPLACE;
+	return ptr;
+    }
+
+    new_heap_node = vikalloc_locked(size);
+    if(new_heap_node == NULL) {
+	return NULL;
+    }
+
+    // The new block never overlaps the old one, which is still in use.
+    stream_copy(new_heap_node, ptr, MIN(size, curr->size));
+    vikfree_locked(ptr);
+    last_path = VIK_PATH_REALLOC_MOVE;
+    return new_heap_node;
+}
+
+void * vikrealloc(void *ptr, size_t size)
+{
+    uint64_t start = 0;
+    void *new_ptr = NULL;
+    uint8_t locked = heap_lock_take();
+    uint8_t timed = latency_tracking;
+
+    // Time the whole call. The allocations and frees inside it go
+    // through vikalloc_locked() and vikfree_locked(), which aren't timed.
+    if (timed) {
+	start = latency_ticks();
+    }
+    new_ptr = vikrealloc_block(ptr, size);
+    if (timed) {
+	latency_record(last_path, start);
+    }
+    heap_lock_drop(locked);
+    return new_ptr;
+}
+
+void * vikstrdup(const char *s)
+{
+    return strcpy(vikalloc(strlen(s)+1), s);
+}
+
+// A vikheap_create() heap keeps its vikheap_t in the first page of its
+// mapping. The heap itself starts HUGE_PAGE_SIZE in, so the region can
+// be committed in huge pages if the options ask for them.
+vikheap_t *vikheap_create(const vikheap_options_t *options)
+{
+    vikheap_options_t defaults;
+    vikheap_t *heap = NULL;
+    void *map = NULL;
+
+    if (NULL == options) {
+	memset(&defaults, 0, sizeof(defaults));
+	defaults.fit_algorithm = NEXT_FIT;
+	options = &defaults;
+    }
+    if (0 == page_size) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    map = region_reserve(HUGE_PAGE_SIZE + (options->reserve ? options->reserve : VIKHEAP_RESERVE));
+    if (NULL == map) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (mmap(map, page_size, PROT_READ | PROT_WRITE
+	     , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	munmap(map, HUGE_PAGE_SIZE + (options->reserve ? options->reserve : VIKHEAP_RESERVE));
+	errno = ENOMEM;
+	return NULL;
+    }
+    heap = map;
+    memset(heap, 0, sizeof(vikheap_t));
+    heap->map_base = map;
+    heap->region_base = map + HUGE_PAGE_SIZE;
+    heap->region_brk = heap->region_base;
+    heap->region_end = heap->region_base + (options->reserve ? options->reserve : VIKHEAP_RESERVE);
+    heap->low_water_mark = heap->region_base;
+    heap->high_water_mark = heap->region_base;
+    heap->use_region = TRUE;
+    heap->use_huge_pages = options->huge_pages ? TRUE : FALSE;
+    heap->free_list_order = FREE_LIST_ADDRESS;
+    heap->isVerbose = options->verbose;
+    heap->fit_algorithm = options->fit_algorithm;
+    heap->min_sbrk_size = MIN_SBRK_SIZE;
+    if (options->min_sbrk_size != 0) {
+	heap->min_sbrk_size = MAX(options->min_sbrk_size, BLOCK_SIZE + BLOCK_SIZE);
+    }
+    return heap;
+}
+
+// Make heap the one the vikalloc() calls work on, taking its lock if it
+// is shared. *saved is set to the heap to go back to, and the return
+// value says whether heap_lock was taken. Both go to heap_leave().
+static uint8_t heap_enter(vikheap_t *heap, vikheap_t **saved)
+{
+    // The maintenance thread looks at cur_heap.
+    uint8_t locked = heap_lock_take();
+
+    if (heap->shared && pthread_mutex_lock(&heap->lock) == EOWNERDEAD) {
+	// Another process died holding the lock. Its call may not have
+	// finished, but there is no way to undo it, so carry on.
+	pthread_mutex_consistent(&heap->lock);
+    }
+    *saved = cur_heap;
+    cur_heap = heap;
+    return locked;
+}
+
+static void heap_leave(vikheap_t *saved, uint8_t locked)
+{
+    if (cur_heap->shared) {
+	pthread_mutex_unlock(&cur_heap->lock);
+    }
+    cur_heap = saved;
+    heap_lock_drop(locked);
+}
+
+vikheap_t *vikheap_init_from_buffer(void *buf, size_t len)
+{
+    uintptr_t start = ((uintptr_t) buf + 15) & ~(uintptr_t) 15;
+    vikheap_t *heap = (vikheap_t *) start;
+    vikheap_t *saved = NULL;
+    uint8_t locked = FALSE;
+    void *heap_start = (void *) (((start + sizeof(vikheap_t)) + 15) & ~(uintptr_t) 15);
+
+    if (NULL == buf || heap_start + BLOCK_SIZE + BLOCK_SIZE + sizeof(free_links_t) > buf + len) {
+	errno = EINVAL;
+	return NULL;
+    }
+    memset(heap, 0, sizeof(vikheap_t));
+    heap->region_base = heap_start;
+    heap->region_end = buf + len;
+    heap->low_water_mark = heap->region_base;
+    heap->use_region = TRUE;
+    heap->fixed = TRUE;
+    heap->free_list_order = FREE_LIST_ADDRESS;
+    heap->fit_algorithm = NEXT_FIT;
+    heap->min_sbrk_size = MIN_SBRK_SIZE;
+    locked = heap_enter(heap, &saved);
+    buffer_format();
+    heap_leave(saved, locked);
+    return heap;
+}
+
+vikheap_t *vikheap_create_shared(int fd, size_t len, void *addr)
+{
+    vikheap_t *heap = NULL;
+    void *map = NULL;
+    pthread_mutexattr_t attr;
+
+    if (ftruncate(fd, len) != 0) {
+	return NULL;
+    }
+    map = mmap(addr, len, PROT_READ | PROT_WRITE
+	       , MAP_SHARED | ((addr != NULL) ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+    if (map == MAP_FAILED) {
+	return NULL;
+    }
+    if (addr != NULL && map != addr) {
+	// Kernels from before MAP_FIXED_NOREPLACE take it as a hint.
+	munmap(map, len);
+	errno = EEXIST;
+	return NULL;
+    }
+    heap = vikheap_init_from_buffer(map, len);
+    if (NULL == heap) {
+	munmap(map, len);
+	return NULL;
+    }
+    heap->map_base = map;
+    heap->shared = TRUE;
+    heap->magic = VIKHEAP_MAGIC;
+
+    // Robust, so that a process dying in the middle of a call doesn't
+    // leave the others waiting on the lock for ever.
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&heap->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return heap;
+}
+
+vikheap_t *vikheap_attach_shared(int fd)
+{
+    vikheap_t *peek = NULL;
+    void *addr = NULL;
+    size_t len = 0;
+    void *map = NULL;
+
+    // Look at the vikheap_t to find out where and how big the heap is.
+    peek = mmap(NULL, sizeof(vikheap_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (peek == MAP_FAILED) {
+	return NULL;
+    }
+    if (peek->magic != VIKHEAP_MAGIC || !peek->shared) {
+	munmap(peek, sizeof(vikheap_t));
+	errno = EINVAL;
+	return NULL;
+    }
+    addr = peek->map_base;
+    len = peek->region_end - peek->map_base;
+    munmap(peek, sizeof(vikheap_t));
+
+    map = mmap(addr, len, PROT_READ | PROT_WRITE
+	       , MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (map == MAP_FAILED) {
+	return NULL;
+    }
+    if (map != addr) {
+	// Kernels from before MAP_FIXED_NOREPLACE take it as a hint.
+	munmap(map, len);
+	errno = EEXIST;
+	return NULL;
+    }
+    return map;
+}
+
+void vikheap_set_root(vikheap_t *heap, void *ptr)
+{
+    heap->root = ptr;
+}
+
+void *vikheap_get_root(vikheap_t *heap)
+{
+    return heap->root;
+}
+
+// TRUE if a block header at __curr would lie inside cur_heap.
+#define HEAP_HAS(__curr) ((void *) (__curr) >= cur_heap->region_base \
+			  && (void *) ((__curr) + 1) <= cur_heap->region_brk)
+
+// Moves a pointer into a heap that was mapped somewhere else.
+#define REBASE(__ptr, __delta) ((__ptr) = (__ptr) ? ((void *) (__ptr)) + (__delta) : NULL)
+
+// Checks that the block list and free list of cur_heap hang together,
+// without trusting any of it, so that a damaged file is turned down
+// instead of crashing a later call.
+static uint8_t heap_verify(void)
+{
+    heap_block_t *curr = NULL;
+    heap_block_t *prev = NULL;
+    size_t avail = 0;
+    size_t listed = 0;
+
+    if (cur_heap->block_list_head != cur_heap->region_base) {
+	return FALSE;
+    }
+    for (curr = cur_heap->block_list_head; curr != NULL; curr = curr->next) {
+	if (!HEAP_HAS(curr) || curr->prev != prev || curr->size > curr->capacity
+	    || curr->capacity > (size_t) (cur_heap->region_brk - BLOCK_DATA(curr))
+	    || (prev != NULL && BLOCK_DATA(prev) + prev->capacity != (void *) curr)) {
+	    return FALSE;
+	}
+	if (IS_AVAIL(curr)) {
+	    avail++;
+	}
+	prev = curr;
+    }
+    if (prev != cur_heap->block_list_tail
+	|| BLOCK_DATA(prev) + prev->capacity != cur_heap->region_end
+	|| !HEAP_HAS(cur_heap->next_fit)
+	|| (cur_heap->free_list_rover != NULL && !HEAP_HAS(cur_heap->free_list_rover))) {
+	return FALSE;
+    }
+
+    // The free list has to hold exactly the blocks IS_AVAIL() picks. The
+    // count stops a loop in the links from going round for ever.
+    prev = NULL;
+    for (curr = cur_heap->free_list_head; curr != NULL; curr = FREE_LINKS(curr)->next_free) {
+	if (++listed > avail || !HEAP_HAS(curr)
+	    || curr->capacity > (size_t) (cur_heap->region_brk - BLOCK_DATA(curr))
+	    || !IS_AVAIL(curr) || FREE_LINKS(curr)->prev_free != prev
+	    || (prev != NULL && FREE_LINKS(prev)->next_capacity != curr->capacity)) {
+	    return FALSE;
+	}
+	prev = curr;
+    }
+    return listed == avail && prev == cur_heap->free_list_tail;
+}
+
+// Checks a heap file mapped at heap, len bytes long, that was made at
+// addr, before anything follows a pointer in it. The region has to be
+// inside the mapping, and the block list has to go up through it one
+// whole block at a time, with every header and its capacity inside the
+// region. The links are still the ones from addr, so each one is moved
+// by delta before it is read.
+static uint8_t file_bounds(vikheap_t *heap, void *addr, size_t len)
+{
+    ptrdiff_t delta = ((void *) heap) - addr;
+    void *base = heap->region_base;
+    void *brk_at = heap->region_brk;
+    heap_block_t *curr = NULL;
+    heap_block_t *block = NULL;
+
+    if (base < addr + sizeof(vikheap_t) || base > brk_at || brk_at > addr + len
+	|| heap->region_end != addr + len
+	|| heap->low_water_mark < base || heap->low_water_mark > heap->region_end
+	|| heap->high_water_mark < base || heap->high_water_mark > heap->region_end) {
+	return FALSE;
+    }
+    for (curr = heap->block_list_head; curr != NULL; curr = block->next) {
+	if ((void *) curr < base || (void *) (curr + 1) > brk_at) {
+	    return FALSE;
+	}
+	block = ((void *) curr) + delta;
+	if (block->capacity > (size_t) (brk_at - BLOCK_DATA(curr))
+	    || (block->next != NULL && block->next <= curr)) {
+	    return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+// Moves every pointer in cur_heap, a heap that has been mapped delta
+// bytes away from where it was made. file_bounds() has to pass first.
+// heap_verify() checks the rest afterwards.
+static void heap_rebase(ptrdiff_t delta)
+{
+    heap_block_t *curr = NULL;
+
+    REBASE(cur_heap->block_list_head, delta);
+    REBASE(cur_heap->block_list_tail, delta);
+    REBASE(cur_heap->low_water_mark, delta);
+    REBASE(cur_heap->high_water_mark, delta);
+    REBASE(cur_heap->next_fit, delta);
+    REBASE(cur_heap->free_list_head, delta);
+    REBASE(cur_heap->free_list_tail, delta);
+    REBASE(cur_heap->free_list_rover, delta);
+    REBASE(cur_heap->region_base, delta);
+    REBASE(cur_heap->region_brk, delta);
+    REBASE(cur_heap->region_end, delta);
+    REBASE(cur_heap->map_base, delta);
+    REBASE(cur_heap->root, delta);
+
+    for (curr = cur_heap->block_list_head; curr != NULL; curr = curr->next) {
+	REBASE(curr->prev, delta);
+	REBASE(curr->next, delta);
+	if (IS_AVAIL(curr)) {
+	    REBASE(FREE_LINKS(curr)->prev_free, delta);
+	    REBASE(FREE_LINKS(curr)->next_free, delta);
+	}
+    }
+}
+
+// Maps a heap file made by vikheap_open_file() back in, at the address
+// it was made at if that is free.
+static vikheap_t *file_reopen(int fd, size_t len)
+{
+    vikheap_t *peek = NULL;
+    vikheap_t *heap = NULL;
+    vikheap_t *saved = NULL;
+    void *addr = NULL;
+    uint8_t ok = FALSE;
+    uint8_t locked = FALSE;
+
+    peek = mmap(NULL, sizeof(vikheap_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (peek == MAP_FAILED) {
 	return NULL;
     }
+    if (len < sizeof(vikheap_t) || peek->magic != VIKHEAP_MAGIC || !peek->persistent
+	|| (size_t) (peek->region_end - peek->map_base) != len) {
+	munmap(peek, sizeof(vikheap_t));
+	errno = EINVAL;
+	return NULL;
+    }
+    addr = peek->map_base;
+    munmap(peek, sizeof(vikheap_t));
 
-    curr = DATA_BLOCK(ptr);
-    if(size <= curr->capacity) {
-	curr->size = size;
-	return ptr;
+    heap = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (heap == MAP_FAILED) {
+	return NULL;
+    }
+    if (!file_bounds(heap, addr, len)) {
+	munmap(heap, len);
+	errno = EINVAL;
+	return NULL;
     }
+    // The maintenance thread looks at cur_heap.
+    locked = heap_lock_take();
+    saved = cur_heap;
+    cur_heap = heap;
+    if ((void *) heap != addr) {
+	heap_rebase(((void *) heap) - addr);
+    }
+    // The first fit index was in the memory of the process that made it.
+    heap->use_treap = FALSE;
+    heap->treap_full = FALSE;
+    heap->treap_slab = NULL;
+    ok = heap_verify();
+    cur_heap = saved;
+    heap_lock_drop(locked);
+    if (!ok) {
+	munmap(heap, len);
+	errno = EINVAL;
+	return NULL;
+    }
+    return heap;
+}
 
-    new_heap_node = vikalloc(size);
-    if(new_heap_node == NULL) {
+vikheap_t *vikheap_open_file(const char *path, size_t len)
+{
+    vikheap_t *heap = NULL;
+    void *map = NULL;
+    struct stat st;
+    int fd = -1;
+    int err = 0;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
 	return NULL;
     }
+    if (fstat(fd, &st) != 0) {
+	err = errno;
+    }
+    else if (st.st_size != 0) {
+	heap = file_reopen(fd, st.st_size);
+	err = errno;
+    }
+    else if (ftruncate(fd, len) != 0
+	     || (map = mmap(VIKHEAP_FILE_ADDR, len, PROT_READ | PROT_WRITE
+			    , MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	err = errno;
+    }
+    else {
+	heap = vikheap_init_from_buffer(map, len);
+	if (NULL == heap) {
+	    err = errno;
+	    munmap(map, len);
+	}
+	else {
+	    heap->map_base = map;
+	    heap->persistent = TRUE;
+	    heap->magic = VIKHEAP_MAGIC;
+	}
+    }
+    // The mapping keeps the file open.
+    close(fd);
+    errno = err;
+    return heap;
+}
+
+int vikheap_sync(vikheap_t *heap)
+{
+    return msync(heap->map_base, heap->region_end - heap->map_base, MS_SYNC);
+}
+
+vikheap_t *vikheap_default(void)
+{
+    return &default_heap;
+}
+
+void *vikheap_alloc(vikheap_t *heap, size_t size)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = heap_enter(heap, &saved);
+    void *ptr = NULL;
+
+    ptr = vikalloc(size);
+    heap_leave(saved, locked);
+    return ptr;
+}
+
+void vikheap_free(vikheap_t *heap, void *ptr)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = heap_enter(heap, &saved);
 
-    memmove(new_heap_node, ptr, MIN(size, curr->size));
     vikfree(ptr);
-    return new_heap_node;
+    heap_leave(saved, locked);
 }
 
-void * vikstrdup(const char *s)
+void *vikheap_calloc(vikheap_t *heap, size_t nmemb, size_t size)
 {
-    return strcpy(vikalloc(strlen(s)+1), s);
+    vikheap_t *saved = NULL;
+    uint8_t locked = heap_enter(heap, &saved);
+    void *ptr = NULL;
+
+    ptr = vikcalloc(nmemb, size);
+    heap_leave(saved, locked);
+    return ptr;
+}
+
+void *vikheap_realloc(vikheap_t *heap, void *ptr, size_t size)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = heap_enter(heap, &saved);
+
+    ptr = vikrealloc(ptr, size);
+    heap_leave(saved, locked);
+    return ptr;
+}
+
+void vikheap_reset(vikheap_t *heap)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = FALSE;
+
+    if (heap == &default_heap) {
+	vikalloc_reset();
+	return;
+    }
+    locked = heap_enter(heap, &saved);
+    heap_reset();
+    heap_leave(saved, locked);
+}
+
+void vikheap_dump(vikheap_t *heap, void *addr)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = heap_enter(heap, &saved);
+
+    vikalloc_dump2(addr);
+    heap_leave(saved, locked);
+}
+
+void vikheap_get_stats(vikheap_t *heap, vikalloc_stats_t *stats)
+{
+    vikheap_t *saved = NULL;
+    uint8_t locked = FALSE;
+
+    if (heap == &default_heap) {
+	vikalloc_get_stats(stats);
+	return;
+    }
+    locked = heap_enter(heap, &saved);
+    heap_get_stats(stats);
+    heap_leave(saved, locked);
+}
+
+void vikheap_destroy(vikheap_t *heap)
+{
+    if (NULL == heap || heap == &default_heap) {
+	return;
+    }
+    if (heap->side_table != NULL) {
+	munmap(heap->side_table, SIDE_TABLE_ENTRIES * sizeof(side_entry_t));
+    }
+    if (heap->treap_slab != NULL) {
+	munmap(heap->treap_slab, TREAP_NODES * sizeof(treap_node_t));
+    }
+    // The heap's own struct goes with the mapping. A buffer heap's
+    // memory belongs to the caller.
+    if (heap->map_base != NULL) {
+	munmap(heap->map_base, heap->region_end - heap->map_base);
+    }
+}
+
+// Each chunk starts with a link to the pool's previous chunk. Objects
+// are handed out from the newest chunk in order, and freed objects go on
+// a list threaded through their first bytes.
+struct vikpool_s {
+    size_t object_size;  // rounded up to a multiple of the alignment
+    size_t alignment;
+    size_t chunk_size;
+    void *chunks;        // the newest chunk
+    void *bump;          // the next object never handed out
+    void *bump_end;
+    void *free_objects;
+};
+
+vikpool_t *vikpool_create(size_t object_size, size_t alignment)
+{
+    vikpool_t *pool = NULL;
+
+    if (0 == alignment) {
+	alignment = sizeof(void *);
+    }
+    if (0 == object_size || (alignment & (alignment - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    pool = vikalloc(sizeof(vikpool_t));
+    if (NULL == pool) {
+	return NULL;
+    }
+    memset(pool, 0, sizeof(vikpool_t));
+    pool->alignment = alignment;
+    pool->object_size = (MAX(object_size, sizeof(void *)) + alignment - 1) & ~(alignment - 1);
+    pool->chunk_size = MAX(POOL_CHUNK_SIZE
+			   , sizeof(void *) + alignment + pool->object_size);
+    return pool;
+}
+
+void *vikpool_alloc(vikpool_t *pool)
+{
+    void *obj = pool->free_objects;
+    void *chunk = NULL;
+
+    if (obj != NULL) {
+	pool->free_objects = *(void **) obj;
+	return obj;
+    }
+    if (NULL == pool->bump || pool->bump + pool->object_size > pool->bump_end) {
+	chunk = vikalloc(pool->chunk_size);
+	if (NULL == chunk) {
+	    return NULL;
+	}
+	*(void **) chunk = pool->chunks;
+	pool->chunks = chunk;
+	// vikalloc() only promises byte alignment.
+	pool->bump = (void *) (((uintptr_t) chunk + sizeof(void *) + pool->alignment - 1)
+			       & ~((uintptr_t) pool->alignment - 1));
+	pool->bump_end = chunk + pool->chunk_size;
+    }
+    obj = pool->bump;
+    pool->bump += pool->object_size;
+    return obj;
+}
+
+void vikpool_free(vikpool_t *pool, void *obj)
+{
+    if (NULL == obj) {
+	return;
+    }
+    *(void **) obj = pool->free_objects;
+    pool->free_objects = obj;
+}
+
+void vikpool_destroy(vikpool_t *pool)
+{
+    void *chunk = NULL;
+
+    if (NULL == pool) {
+	return;
+    }
+    while (pool->chunks != NULL) {
+	chunk = pool->chunks;
+	pool->chunks = *(void **) chunk;
+	vikfree(chunk);
+    }
+    vikfree(pool);
+}
+
+// A handle's object keeps a pointer back to its slot in front of the
+// user's data, so vikalloc_compact() can find the slot to update when it
+// moves the object. A free slot holds the next free slot instead.
+struct vikhandle_s {
+    void *ptr;
+};
+
+#define HANDLE_PREFIX (sizeof(vikhandle_t *))
+#define HANDLE_OF(__curr) (*(vikhandle_t **) BLOCK_DATA(__curr))
+
+// TRUE if a block holds the object of a live handle.
+#define IS_MOVABLE(__curr) (!IS_FREE(__curr) && CURR_SIZE(__curr) >= HANDLE_PREFIX \
+			    && HANDLE_OF(__curr) >= cur_heap->handle_table \
+			    && HANDLE_OF(__curr) < cur_heap->handle_table + cur_heap->handles_used \
+			    && HANDLE_OF(__curr)->ptr == BLOCK_DATA(__curr) + HANDLE_PREFIX)
+
+static vikhandle_t *heap_handle(size_t size)
+{
+    vikhandle_t *handle = NULL;
+    void *ptr = NULL;
+
+    if (0 == size) {
+	return NULL;
+    }
+    if (NULL == cur_heap->handle_table) {
+	cur_heap->handle_table = mmap(NULL, HANDLE_TABLE_ENTRIES * sizeof(vikhandle_t)
+				      , PROT_READ | PROT_WRITE
+				      , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == cur_heap->handle_table) {
+	    cur_heap->handle_table = NULL;
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+    // Handles are always blocks, never medium objects, so they can move.
+    ptr = vikalloc_block(size + HANDLE_PREFIX);
+    if (NULL == ptr) {
+	return NULL;
+    }
+
+    // Free slots can't be reused inside a checkpoint, for the same
+    // reason as side table entries.
+    if (cur_heap->handle_free != NULL && NULL == cur_heap->checkpoint) {
+	handle = cur_heap->handle_free;
+	cur_heap->handle_free = handle->ptr;
+    } else if (cur_heap->handles_used < HANDLE_TABLE_ENTRIES) {
+	handle = &cur_heap->handle_table[cur_heap->handles_used++];
+    } else {
+	vikfree_block(ptr);
+	errno = ENOMEM;
+	return NULL;
+    }
+    *(vikhandle_t **) ptr = handle;
+    handle->ptr = ptr + HANDLE_PREFIX;
+    return handle;
+}
+
+vikhandle_t *vikalloc_handle(size_t size)
+{
+    uint8_t locked = heap_lock_take();
+    vikhandle_t *handle = heap_handle(size);
+
+    heap_lock_drop(locked);
+    return handle;
+}
+
+void *vikhandle_get(vikhandle_t *handle)
+{
+    return handle->ptr;
+}
+
+void vikhandle_free(vikhandle_t *handle)
+{
+    uint8_t locked = FALSE;
+
+    if (NULL == handle) {
+	return;
+    }
+    locked = heap_lock_take();
+    vikfree(handle->ptr - HANDLE_PREFIX);
+    if (NULL == cur_heap->checkpoint) {
+	handle->ptr = cur_heap->handle_free;
+	cur_heap->handle_free = handle;
+    }
+    heap_lock_drop(locked);
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Moves the handle's object in the block after the free block curr down
+// to the start of curr, which leaves the free space after it, joined with
+// the block after that if it was free too. Returns the free block, or the
+// block after the moved one if there wasn't room for a free block.
+static heap_block_t *compact_slide(heap_block_t *curr)
+{
+    heap_block_t *moved = curr->next;
+    heap_block_t *after = moved->next;
+    vikhandle_t *handle = HANDLE_OF(moved);
+    size_t size = moved->size;
+    size_t span = curr->capacity + BLOCK_SIZE + moved->capacity;
+    heap_block_t *gap = NULL;
+
+    // Everything comes off the free list while the capacities still say
+    // where the links are.
+    cur_heap->next_fit = curr;
+    if (IS_AVAIL(curr)) {
+	free_list_remove(curr);
+    }
+    if (IS_AVAIL(moved)) {
+	free_list_remove(moved);
+    }
+    if (after != NULL && IS_FREE(after)) {
+	if (IS_AVAIL(after)) {
+	    free_list_remove(after);
+	}
+	span += BLOCK_SIZE + after->capacity;
+	after = after->next;
+    }
+
+    memmove(BLOCK_DATA(curr), BLOCK_DATA(moved), size);
+    curr->size = size;
+    handle->ptr = BLOCK_DATA(curr) + HANDLE_PREFIX;
+    if (span - size < BLOCK_SIZE) {
+	// Too little left over for a block of its own.
+	curr->capacity = span;
+	curr->next = after;
+    } else {
+	curr->capacity = size;
+	gap = BLOCK_DATA(curr) + size;
+	gap->capacity = span - size - BLOCK_SIZE;
+	gap->size = 0;
+	gap->prev = curr;
+	gap->next = after;
+	curr->next = gap;
+    }
+    if (after != NULL) {
+	after->prev = curr->next == after ? curr : gap;
+    } else {
+	cur_heap->block_list_tail = curr->next == NULL ? curr : gap;
+    }
+    if (NULL == gap) {
+	return after;
+    }
+    if (IS_AVAIL(gap)) {
+	free_list_insert(gap);
+	if (purge_advice != PURGE_NONE) {
+	    purge_note_free(gap);
+	}
+    }
+    return gap;
+}
+
+// Gives the free block at the end of the heap, if there is one, back to
+// the kernel. A region can only shrink by whole (huge) pages.
+static void compact_trim(void)
+{
+    heap_block_t *tail = cur_heap->block_list_tail;
+    heap_block_t *prev = NULL;
+    uint8_t avail = FALSE;
+    uintptr_t gran = 1;
+    void *end = NULL;
+
+    if (cur_heap->fixed || NULL == tail || !IS_FREE(tail)) {
+	return;
+    }
+    if (cur_heap->use_region) {
+	if (0 == page_size) {
+	    page_size = sysconf(_SC_PAGESIZE);
+	}
+	gran = cur_heap->use_huge_pages ? HUGE_PAGE_SIZE : page_size;
+    }
+    end = (void *) (((uintptr_t) tail + gran - 1) & ~(gran - 1));
+    if (end != (void *) tail && end < BLOCK_DATA(tail)) {
+	end += gran;
+    }
+    if (end >= cur_heap->high_water_mark) {
+	return;
+    }
+    // This can run in the maintenance thread, long after the heap last
+    // grew. If anything else has moved the break since, what is above
+    // the heap is theirs.
+    if (!cur_heap->use_region && sbrk(0) != cur_heap->high_water_mark) {
+	return;
+    }
+
+    // Once the memory is gone, so is the header of a tail that ends
+    // up at the break.
+    prev = tail->prev;
+    avail = IS_AVAIL(tail);
+    if (avail) {
+	free_list_remove(tail);
+    }
+    if (cur_heap->use_region
+	? mmap(end, cur_heap->region_brk - end, PROT_NONE
+	       , MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED
+	: brk(end) != 0) {
+	if (avail) {
+	    free_list_insert(tail);
+	}
+	return;
+    }
+    if (cur_heap->use_region) {
+	cur_heap->region_brk = end;
+    }
+    cur_heap->high_water_mark = end;
+
+    if (end == (void *) tail) {
+	cur_heap->block_list_tail = prev;
+	if (prev != NULL) {
+	    prev->next = NULL;
+	} else {
+	    cur_heap->block_list_head = NULL;
+	}
+	if (cur_heap->compact_cursor == tail) {
+	    cur_heap->compact_cursor = NULL;
+	}
+	if (cur_heap->next_fit == tail) {
+	    cur_heap->next_fit = cur_heap->block_list_head;
+	}
+    } else {
+	tail->capacity = end - BLOCK_DATA(tail);
+	if (IS_AVAIL(tail)) {
+	    free_list_insert(tail);
+	}
+    }
+}
+
+static uint8_t heap_compact(unsigned budget_us)
+{
+    uint64_t deadline = now_us() + budget_us;
+    heap_block_t *curr = NULL;
+
+    if (cur_heap->checkpoint != NULL || NULL == cur_heap->block_list_head) {
+	// Blocks from before a checkpoint can't move.
+	return TRUE;
+    }
+    curr = (cur_heap->compact_cursor != NULL)
+	? cur_heap->compact_cursor : cur_heap->block_list_head;
+    while (curr != NULL) {
+	if (IS_FREE(curr) && curr->next != NULL && IS_MOVABLE(curr->next)) {
+	    curr = compact_slide(curr);
+	} else {
+	    curr = curr->next;
+	}
+	if (budget_us != 0 && now_us() >= deadline) {
+	    break;
+	}
+    }
+    cur_heap->compact_cursor = curr;
+    if (NULL == curr) {
+	compact_trim();
+    }
+
+    // Blocks have moved under next_fit and the rover, so the next search
+    // starts over at the head.
+    cur_heap->next_fit = cur_heap->block_list_head;
+    cur_heap->free_list_rover = NULL;
+    return NULL == curr;
+}
+
+uint8_t vikalloc_compact(unsigned budget_us)
+{
+    uint8_t locked = heap_lock_take();
+    uint8_t done = heap_compact(budget_us);
+
+    heap_lock_drop(locked);
+    return done;
+}
+
+// The background maintenance thread. Every maint_period_ms it takes the
+// heap lock and, for up to maint_budget_us, does the frees vikfree() put
+// off, gives the free tail of the heap back, runs a purge pass, and
+// flushes the caches (and the transfer cache) no thread has touched
+// since the last pass.
+static pthread_t maint_thread;
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t maint_stop = FALSE;
+static unsigned maint_period_ms = 0;
+static unsigned maint_budget_us = 0;
+
+// Flushes cache back to the heap if nobody has used it since the last
+// time. A cache that is busy right now isn't stale.
+static void maint_flush_cache(cache_t *cache)
+{
+    unsigned cls = 0;
+
+    if (__atomic_test_and_set(&cache->busy, __ATOMIC_ACQUIRE)) {
+	return;
+    }
+    if (!cache->touched) {
+	for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	    maint_flushed_bytes += cache->count[cls] * CACHE_CLASS_SIZE(cls);
+	}
+	cache_flush_all(cache);
+    }
+    cache->touched = FALSE;
+    __atomic_clear(&cache->busy, __ATOMIC_RELEASE);
+}
+
+static void maint_flush_transfer(void)
+{
+    unsigned cls = 0;
+    void *obj = NULL;
+    void *next = NULL;
+
+    pthread_mutex_lock(&transfer_lock);
+    if (!transfer_touched) {
+	for (cls = 0; cls < CACHE_CLASSES; cls++) {
+	    while (transfer[cls].count > 0) {
+		obj = transfer[cls].batches[--transfer[cls].count];
+		for ( ; obj != NULL; obj = next) {
+		    next = *(void **) obj;
+		    cache_unpark(obj);
+		    vikfree_block(obj);
+		}
+		maint_flushed_bytes += CACHE_BATCH * CACHE_CLASS_SIZE(cls);
+	    }
+	}
+    }
+    transfer_touched = FALSE;
+    pthread_mutex_unlock(&transfer_lock);
+}
+
+void vikalloc_maintain(void)
+{
+    uint64_t start = now_us();
+    uint64_t deadline = start + maint_budget_us;
+    void *top = NULL;
+    cache_t *cache = NULL;
+    unsigned cpu = 0;
+    uint8_t locked = heap_lock_take();
+
+    // Someone else's heap, or one with a checkpoint open, is left alone.
+    if (cur_heap != &default_heap || cur_heap->checkpoint != NULL) {
+	heap_lock_drop(locked);
+	return;
+    }
+    maint_drain();
+    if (0 == maint_budget_us || now_us() < deadline) {
+	top = cur_heap->high_water_mark;
+	compact_trim();
+	maint_trimmed_bytes += top - cur_heap->high_water_mark;
+    }
+    if (purge_advice != PURGE_NONE && (0 == maint_budget_us || now_us() < deadline)) {
+	vikalloc_purge();
+    }
+    if (cache_mode != CACHE_NONE) {
+	for (cache = thread_caches; cache != NULL; cache = cache->next) {
+	    maint_flush_cache(cache);
+	}
+	for (cpu = 0; cpu < CACHE_MAX_CPUS; cpu++) {
+	    if (maint_budget_us != 0 && now_us() >= deadline) {
+		break;
+	    }
+	    maint_flush_cache(&cpu_caches[cpu].cache);
+	}
+	maint_flush_transfer();
+    }
+    maint_passes++;
+    maint_busy_us += now_us() - start;
+    heap_lock_drop(locked);
+}
+
+static void *maint_main(void *arg)
+{
+    struct timespec wake;
+
+    pthread_mutex_lock(&maint_mutex);
+    while (!maint_stop) {
+	clock_gettime(CLOCK_REALTIME, &wake);
+	wake.tv_sec += maint_period_ms / 1000;
+	wake.tv_nsec += (long) (maint_period_ms % 1000) * 1000000;
+	if (wake.tv_nsec >= 1000000000) {
+	    wake.tv_sec++;
+	    wake.tv_nsec -= 1000000000;
+	}
+	if (pthread_cond_timedwait(&maint_cond, &maint_mutex, &wake) != ETIMEDOUT) {
+	    continue;
+	}
+	pthread_mutex_unlock(&maint_mutex);
+	vikalloc_maintain();
+	pthread_mutex_lock(&maint_mutex);
+    }
+    pthread_mutex_unlock(&maint_mutex);
+    return arg;
+}
+
+int vikalloc_set_maintenance(unsigned period_ms, unsigned budget_us)
+{
+    int err = 0;
+
+    if (maint_running) {
+	pthread_mutex_lock(&maint_mutex);
+	maint_stop = TRUE;
+	pthread_cond_signal(&maint_cond);
+	pthread_mutex_unlock(&maint_mutex);
+	pthread_join(maint_thread, NULL);
+	maint_running = FALSE;
+	// Finish what the thread left, so nothing stays pending.
+	pthread_mutex_lock(&heap_lock);
+	maint_drain();
+	__atomic_store_n(&heap_locking, cache_mode != CACHE_NONE, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&heap_lock);
+    }
+    if (0 == period_ms) {
+	return 0;
+    }
+    heap_lock_init();
+    maint_period_ms = period_ms;
+    maint_budget_us = budget_us;
+    maint_stop = FALSE;
+    __atomic_store_n(&heap_locking, TRUE, __ATOMIC_RELAXED);
+    err = pthread_create(&maint_thread, NULL, maint_main, NULL);
+    if (err != 0) {
+	__atomic_store_n(&heap_locking, cache_mode != CACHE_NONE, __ATOMIC_RELAXED);
+	errno = err;
+	return -1;
+    }
+    maint_running = TRUE;
+    return 0;
 }
 
 // This is unbelievably ugly.
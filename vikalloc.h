@@ -13,6 +13,30 @@
 # include <stdlib.h>
 # include <stdio.h>
 
+// Build variants.
+// Define these when compiling vikalloc.c to fix a policy at compile time.
+//   The matching setter then has no effect, and vikalloc()/vikfree() have
+//   no runtime checks on it.
+//   VIKALLOC_QUIET                 strip all verbose logging
+//   VIKALLOC_FIXED_FIT=<algorithm> fix the fit algorithm, e.g. NEXT_FIT
+//   VIKALLOC_FIXED_FREE_LIST=<order> fix the free list order
+// VIKALLOC_PRODUCTION selects all of the above for next fit with an
+//   address ordered free list, and disables assert.
+# ifdef VIKALLOC_PRODUCTION
+#  ifndef NDEBUG
+#   define NDEBUG
+#  endif // NDEBUG
+#  ifndef VIKALLOC_QUIET
+#   define VIKALLOC_QUIET
+#  endif // VIKALLOC_QUIET
+#  ifndef VIKALLOC_FIXED_FIT
+#   define VIKALLOC_FIXED_FIT NEXT_FIT
+#  endif // VIKALLOC_FIXED_FIT
+#  ifndef VIKALLOC_FIXED_FREE_LIST
+#   define VIKALLOC_FIXED_FREE_LIST FREE_LIST_ADDRESS
+#  endif // VIKALLOC_FIXED_FREE_LIST
+# endif // VIKALLOC_PRODUCTION
+
 // enable the define below to disable assert.
 //# define NDEBUG
 # include <assert.h>
@@ -42,6 +66,17 @@ typedef enum {
     , NEXT_FIT // the algorithm we are going to use
 } vikalloc_fit_algorithm_t;
 
+// Allows you to specify the order of the free list that vikalloc()
+//   searches. Only blocks with room for another request are on the
+//   free list, so a search never visits blocks that are in use.
+// FREE_LIST_ADDRESS keeps the search order the same as walking the
+//   whole heap, but vikfree() has to look for the block's neighbours
+//   on the list. FREE_LIST_LIFO puts freed blocks at the front in O(1).
+typedef enum {
+    FREE_LIST_ADDRESS // the default
+    , FREE_LIST_LIFO
+} vikalloc_free_list_order_t;
+
 // This is the default value set to the variable min_sbrk_size. The
 // variable min_sbrk_size can be changed with a call to vikalloc_set_min().
 # ifndef MIN_SBRK_SIZE
@@ -55,6 +90,157 @@ typedef enum {
 #  define SILLY_SBRK_SIZE 128
 # endif // SILLY_SBRK_SIZE
 
+// The size of a huge page, used when the heap is backed by huge pages
+// (see vikalloc_set_huge_pages()). The heap then grows by multiples of
+// this, from a region aligned to it.
+# ifndef HUGE_PAGE_SIZE
+#  define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+# endif // HUGE_PAGE_SIZE
+
+// How much address space to reserve for a huge page backed heap. Only
+// the part the heap has grown into is committed.
+# ifndef HUGE_REGION_RESERVE
+#  define HUGE_REGION_RESERVE ((size_t) 64 * 1024 * 1024 * 1024)
+# endif // HUGE_REGION_RESERVE
+
+// Free blocks are only purged (see vikalloc_set_purge()) if they have
+// at least this many bytes of whole pages inside them.
+# ifndef PURGE_MIN_BYTES
+#  define PURGE_MIN_BYTES (64 * 1024)
+# endif // PURGE_MIN_BYTES
+
+// The sampling profiler keeps the last PROFILE_RING_SIZE samples, each
+// with a backtrace of up to PROFILE_DEPTH frames. PROFILE_RING_SIZE has
+// to be a power of two.
+# ifndef PROFILE_RING_SIZE
+#  define PROFILE_RING_SIZE 1024
+# endif // PROFILE_RING_SIZE
+# ifndef PROFILE_DEPTH
+#  define PROFILE_DEPTH 16
+# endif // PROFILE_DEPTH
+
+// Pools (see vikpool_create()) get their objects from chunks of at
+// least this many bytes.
+# ifndef POOL_CHUNK_SIZE
+#  define POOL_CHUNK_SIZE (64 * 1024)
+# endif // POOL_CHUNK_SIZE
+
+// How much address space to reserve for a vikheap_create() heap when
+// the options don't say.
+# ifndef VIKHEAP_RESERVE
+#  define VIKHEAP_RESERVE ((size_t) 16 * 1024 * 1024 * 1024)
+# endif // VIKHEAP_RESERVE
+
+// Where vikheap_open_file() would like a new heap file to be mapped.
+// Reopening it maps it at the same address again when that is free.
+# ifndef VIKHEAP_FILE_ADDR
+#  define VIKHEAP_FILE_ADDR ((void *) 0x340000000000UL)
+# endif // VIKHEAP_FILE_ADDR
+
+// The most handles (see vikalloc_handle()) a heap can have at once.
+# ifndef HANDLE_TABLE_ENTRIES
+#  define HANDLE_TABLE_ENTRIES ((size_t) 1 << 24)
+# endif // HANDLE_TABLE_ENTRIES
+
+// The most blocks the free list side table can hold at once.
+# ifndef SIDE_TABLE_ENTRIES
+#  define SIDE_TABLE_ENTRIES ((size_t) 1 << 26)
+# endif // SIDE_TABLE_ENTRIES
+
+// The most free blocks the first fit index can hold at once. A heap
+// with more than that searches the free list instead.
+# ifndef TREAP_NODES
+#  define TREAP_NODES ((size_t) 1 << 26)
+# endif // TREAP_NODES
+
+// A vikrealloc() that shrinks a block and leaves at least this many
+// bytes of it unused (plus a header) splits them off as a free block.
+# ifndef REALLOC_SPLIT_MIN
+#  define REALLOC_SPLIT_MIN 4096
+# endif // REALLOC_SPLIT_MIN
+
+// Requests of at least this many bytes get a mapping of their own
+// (see vikalloc_set_large_min()).
+# ifndef LARGE_MIN_SIZE
+#  define LARGE_MIN_SIZE ((size_t) 1 << 25)
+# endif // LARGE_MIN_SIZE
+
+// vikcalloc() and vikrealloc() zero or copy buffers of at least this
+// many bytes with non-temporal stores (see vikalloc_set_stream_min()).
+# ifndef STREAM_MIN_SIZE
+#  define STREAM_MIN_SIZE ((size_t) 1 << 21)
+# endif // STREAM_MIN_SIZE
+
+// Requests from MEDIUM_MIN_SIZE to MEDIUM_MAX_SIZE bytes go to the
+// medium object engine when it is on (see vikalloc_set_medium()). Its
+// size classes, in vikalloc_size_classes.h, are multiples of
+// MEDIUM_GRANULE, and it carves them from runs of MEDIUM_RUN_SIZE bytes.
+# define MEDIUM_MIN_SIZE 256
+# define MEDIUM_MAX_SIZE (32 * 1024)
+# define MEDIUM_GRANULE 64
+# define MEDIUM_RUN_SHIFT 17
+# define MEDIUM_RUN_SIZE ((size_t) 1 << MEDIUM_RUN_SHIFT)
+
+// How much address space to reserve for medium objects.
+# ifndef MEDIUM_ARENA_RESERVE
+#  define MEDIUM_ARENA_RESERVE ((size_t) 16 * 1024 * 1024 * 1024)
+# endif // MEDIUM_ARENA_RESERVE
+
+// With a cache mode set (see vikalloc_set_cache_mode()), requests of up
+// to CACHE_MAX_SIZE bytes are rounded up to a size class, a multiple of
+// CACHE_GRANULE from vikalloc_size_classes.h, and served from a cache. A
+// cache keeps up to CACHE_CLASS_MAX blocks of each size, and gets them
+// from the heap CACHE_BATCH at a time.
+# define CACHE_GRANULE 16
+# define CACHE_MAX_SIZE 256
+# ifndef CACHE_CLASS_MAX
+#  define CACHE_CLASS_MAX 64
+# endif // CACHE_CLASS_MAX
+# ifndef CACHE_BATCH
+#  define CACHE_BATCH 16
+# endif // CACHE_BATCH
+// Batches of each size the transfer cache holds before batches go back
+// to the heap instead.
+# ifndef TRANSFER_BATCHES
+#  define TRANSFER_BATCHES 64
+# endif // TRANSFER_BATCHES
+// Frees the maintenance thread can have pending before vikfree() does
+// them itself again.
+# ifndef MAINT_PENDING_MAX
+#  define MAINT_PENDING_MAX 4096
+# endif // MAINT_PENDING_MAX
+// CPUs past this many share caches.
+# ifndef CACHE_MAX_CPUS
+#  define CACHE_MAX_CPUS 256
+# endif // CACHE_MAX_CPUS
+
+// Where the small object caches are kept.
+typedef enum {
+    CACHE_NONE      // no caches, and no locking (the default)
+    , CACHE_THREAD  // one cache per thread
+    , CACHE_CPU     // one cache per CPU, so memory is bounded by the core count
+} vikalloc_cache_mode_t;
+
+// How vikalloc hands the pages of large free blocks back to the kernel.
+typedef enum {
+    PURGE_NONE        // never (the default)
+    , PURGE_DONTNEED  // madvise(MADV_DONTNEED), RSS drops right away
+    , PURGE_FREE      // madvise(MADV_FREE), the kernel takes them when it needs to
+} vikalloc_purge_advice_t;
+
+// A heap. Every heap has its own blocks, free list and settings.
+typedef struct vikheap_s vikheap_t;
+
+// How a heap made by vikheap_create() works. A size of 0 means the
+// default size.
+typedef struct vikheap_options_s {
+    vikalloc_fit_algorithm_t fit_algorithm; // as vikalloc_set_algorithm()
+    size_t min_sbrk_size;   // the least to grow the heap by, as vikalloc_set_min()
+    uint8_t verbose;
+    uint8_t huge_pages;     // back the heap with huge pages
+    size_t reserve;         // the most the heap can grow to, 0 means VIKHEAP_RESERVE
+} vikheap_options_t;
+
 typedef struct heap_block_s {
     size_t capacity;
     size_t size;
@@ -63,6 +249,55 @@ typedef struct heap_block_s {
     struct heap_block_s *next;
 } heap_block_t;
 
+// Statistics about the heap, filled in by vikalloc_get_stats().
+typedef struct vikalloc_stats_s {
+    size_t heap_bytes;      // bytes between the low and high water marks
+    size_t huge_page_bytes; // bytes of the heap backed by huge pages
+    size_t live_bytes;      // bytes the user has asked for and not freed
+    size_t rss_bytes;       // bytes of the heap that are resident
+    size_t purged_bytes;    // bytes handed back by purging, ever
+    size_t search_skips;    // searches skipped by the search hint, ever
+    size_t medium_bytes;    // bytes of runs in the medium object arena
+    size_t cache_bytes;     // bytes of blocks sitting in the small object caches
+    size_t transfer_bytes;  // bytes of blocks in the transfer cache between them
+    size_t maint_passes;    // passes the maintenance thread has made, ever
+    size_t maint_frees;     // frees it did for vikfree(), ever
+    size_t maint_trimmed_bytes; // bytes it gave back from the end of the heap, ever
+    size_t maint_flushed_bytes; // bytes it flushed from idle caches, ever
+    uint64_t maint_busy_us; // microseconds it has spent working, ever
+    size_t streamed_bytes;  // bytes zeroed or copied around the caches, ever
+    size_t large_bytes;     // bytes mapped for large objects
+    size_t large_remaps;    // large objects resized with mremap(), ever
+} vikalloc_stats_t;
+
+// The paths a call can take, for latency tracking.
+typedef enum {
+    VIK_PATH_REUSE              // vikalloc() reused a free block whole
+    , VIK_PATH_SPLIT            // vikalloc() split a block from the free list
+    , VIK_PATH_GROW             // vikalloc() grew the heap (sbrk() or mmap())
+    , VIK_PATH_FREE             // vikfree() with nothing to coalesce
+    , VIK_PATH_COALESCE         // vikfree() that coalesced with a neighbour
+    , VIK_PATH_REALLOC_INPLACE  // vikrealloc() that fit in the old block
+    , VIK_PATH_REALLOC_MOVE     // vikrealloc() that moved the data
+    , VIK_PATH_MEDIUM           // vikalloc() of a medium object
+    , VIK_PATH_MEDIUM_FREE      // vikfree() of a medium object
+    , VIK_PATH_CACHE            // vikalloc() through a small object cache
+    , VIK_PATH_CACHE_FREE       // vikfree() into a small object cache
+    , VIK_PATH_COUNT
+} vikalloc_path_t;
+
+// One bucket for each power of two ticks.
+# define LATENCY_BUCKETS 64
+
+// Latency histograms, one per path. A call that took t ticks is counted
+// in buckets[path][i] where 2^i <= t < 2^(i+1).
+typedef struct vikalloc_latency_s {
+    double ns_per_tick;
+    uint64_t count[VIK_PATH_COUNT];
+    uint64_t max_ticks[VIK_PATH_COUNT];
+    uint64_t buckets[VIK_PATH_COUNT][LATENCY_BUCKETS];
+} vikalloc_latency_t;
+
 // The basic memory allocator.
 // If you pass NULL or 0, then NULL is returned.
 // If, for some reason, the system cannot allocate the requested
@@ -94,6 +329,9 @@ void *vikcalloc(size_t nmemb, size_t size);
 // into the new block, and the old block deallocated.
 // If you pass NULL as the pointer to old memory, this will behave the
 // same as vikalloc.
+// Shrinking stays in place. If that leaves REALLOC_SPLIT_MIN bytes or
+// more unused, they go back to the heap as a free block.
+// Large objects (see vikalloc_set_large_min()) are resized with mremap().
 void *vikrealloc(void *ptr, size_t size);
 
 // This is like the strdup() function call.
@@ -116,10 +354,41 @@ void vikalloc_dump2(void *);
 //   to restart building the heap again.
 void vikalloc_reset(void);
 
+// Take a checkpoint of the heap, to go back to with vikalloc_rollback().
+//   Checkpoints can be stacked. While one is open, new blocks come from
+//   the top of the heap, and blocks from before it are left as they are:
+//   freeing one is put off until the checkpoint is committed.
+//   vikalloc_dump2() only shows the blocks since the innermost one, and
+//   the free list order and side table can't be changed.
+// Returns 0, or -1 and sets errno. A heap in a caller's buffer can't
+//   take checkpoints (EINVAL).
+int vikalloc_checkpoint(void);
+
+// Drop everything allocated since the innermost checkpoint, and undo
+//   the frees since then, in one step. The memory goes back to the
+//   kernel. Settings changed since the checkpoint go back too.
+// Returns 0, or -1 with errno set to EINVAL if there is no checkpoint.
+int vikalloc_rollback(void);
+
+// Keep everything done since the innermost checkpoint and close it.
+//   The frees that were put off are done now.
+// Returns 0, or -1 with errno set to EINVAL if there is no checkpoint.
+int vikalloc_commit(void);
+
 // Set the fit algorithm.
 // This should modify a variable that is static to your C module.
+//   FIRST_FIT gives the lowest block with room, whatever the free list
+//   order. It keeps an index of the free blocks by address, where each
+//   node also knows the most room in its subtree, so a search is
+//   O(log n) instead of a walk of the list. The index is built the first
+//   time it is needed. Shared heaps have no index and walk the list from
+//   its head, which is only lowest first with an address ordered list.
 void vikalloc_set_algorithm(vikalloc_fit_algorithm_t);
 
+// Set the order of the free list. The list is rebuilt in the new
+// order, so this can be called at any time.
+void vikalloc_set_free_list_order(vikalloc_free_list_order_t);
+
 // Set the verbosity of your vikalloc() code (and related functions).
 // This should modify a variable that is static to your C module.
 void vikalloc_set_verbose(uint8_t);
@@ -133,4 +402,289 @@ void vikalloc_set_log(FILE *);
 // Passing 0 returns the current chunk size.
 size_t vikalloc_set_min(size_t);
 
+// Back the heap with huge pages instead of growing it with sbrk().
+// The heap grows through a HUGE_PAGE_SIZE aligned region reserved with
+//   mmap(), using MAP_HUGETLB if the host has huge pages set aside, and
+//   madvise(MADV_HUGEPAGE) otherwise. On a host without transparent
+//   huge pages this still works, just with normal pages.
+// This can only be changed while the heap is empty (before the first
+//   vikalloc() or after vikalloc_reset()).
+// Returns TRUE if the heap is backed by huge pages after the call.
+uint8_t vikalloc_set_huge_pages(uint8_t);
+
+// Hand the whole pages inside large free blocks back to the kernel, so
+//   a free block in the middle of the heap does not stay resident.
+// A block is purged once it has been free for decay_ms milliseconds.
+//   With a decay of 0, vikfree() purges right away. Otherwise, vikfree()
+//   runs vikalloc_purge() at most once per decay period, and you can
+//   call it yourself from somewhere off the request path.
+void vikalloc_set_purge(vikalloc_purge_advice_t, unsigned decay_ms);
+
+// Purge the free blocks that have been free for longer than the decay.
+// Returns the number of bytes purged.
+size_t vikalloc_purge(void);
+
+// Keep the free list in a side table instead of in the free blocks.
+//   Each free block then holds only a pointer to its entry, and the
+//   entry holds the links and the block's excess capacity, so a search
+//   in vikalloc() reads the packed table instead of a cache line of
+//   every free block it passes. Placement is the same either way.
+// The table has room for SIDE_TABLE_ENTRIES free blocks. A heap with
+//   more than that turns it off and keeps the links in the blocks.
+// Can be switched at any time. Returns TRUE if the side table is on
+//   after the call.
+uint8_t vikalloc_set_side_table(uint8_t);
+
+// Prefetch ahead while vikalloc() walks the free list. The walk is a
+//   chain of dependent loads, one or two cache misses per free block on
+//   a large heap, and prefetching lets the next miss start while the
+//   current block is checked. Off by default. bench.c has a case that
+//   compares the two on a heap with 100k free blocks.
+void vikalloc_set_prefetch(uint8_t);
+
+// A search of the free list that finds nothing remembers the largest
+//   free space it saw, and a later request for more than that goes
+//   straight to growing the heap instead of walking the list again.
+//   Freeing raises the bound when a block goes back on the list with
+//   more. On by default; placement is the same either way.
+void vikalloc_set_search_hint(uint8_t);
+
+// vikcalloc() and vikrealloc() zero or copy at least min_size bytes
+//   with non-temporal (AVX2 or SSE2, found with CPUID) stores, which go
+//   around the caches. Clearing or moving a buffer of many megabytes
+//   then doesn't evict the rest of the program's working set, at the
+//   cost of the buffer itself not being in the cache afterwards. Smaller
+//   buffers use memset() and memcpy(). 0 always uses those. The default
+//   is STREAM_MIN_SIZE. bench.c measures both.
+void vikalloc_set_stream_min(size_t);
+
+// Give requests of min_size bytes or more a mapping of their own instead
+//   of a block in the heap. vikrealloc() resizes them with mremap(),
+//   which lets the kernel move the pages instead of copying the bytes,
+//   so growing a buffer of gigabytes costs neither a copy nor twice the
+//   memory. A large object that shrinks below half of min_size moves
+//   back into the heap, and freeing one unmaps it. Requests made while a
+//   checkpoint is open always stay in the heap. 0 turns this off. The
+//   default is LARGE_MIN_SIZE.
+void vikalloc_set_large_min(size_t);
+
+// Send requests from MEDIUM_MIN_SIZE to MEDIUM_MAX_SIZE bytes to the
+//   medium object engine instead of the block list. It rounds them up to
+//   one of MEDIUM_CLASSES size classes and hands out slots from 128 KB
+//   runs that each hold one class. A bitmap per run, kept away from the
+//   run, tracks the free slots, so a medium object has no header and
+//   finding a free slot is a bit scan.
+// Medium objects are freed and reallocated as usual and are released by
+//   vikalloc_reset(). They don't show in vikalloc_dump2().
+// Returns TRUE if medium objects are on after the call.
+uint8_t vikalloc_set_medium(uint8_t);
+
+// Turn on the small object caches, and with them locking, so that
+//   vikalloc(), vikfree(), vikcalloc(), vikrealloc() and vikalloc_reset()
+//   can be called from any number of threads. Small requests to the
+//   default heap are served from a cache without taking the heap lock.
+//   Everything else takes it, and so do cached calls while the profiler
+//   or latency tracking is on, to record them.
+// CACHE_THREAD gives each thread a cache, which is flushed when the
+//   thread exits. CACHE_CPU gives each CPU one instead, found through
+//   the rseq area glibc registers (or getcpu() without it), so thousands
+//   of threads don't cost thousands of caches.
+// Caches trade batches of CACHE_BATCH blocks through a transfer cache,
+//   so blocks freed by one thread are soon handed out by another.
+// Blocks in a cache count as in use in vikalloc_dump2() and the stats
+//   (see cache_bytes and transfer_bytes). Changing the mode flushes the
+//   caches, and should be done while only one thread is using the heap.
+// Returns the mode in effect after the call.
+vikalloc_cache_mode_t vikalloc_set_cache_mode(vikalloc_cache_mode_t);
+
+// Start a background maintenance thread that wakes every period_ms and
+//   spends up to budget_us (0 for no limit) on work that would otherwise
+//   be done inside vikfree() or not at all: the coalescing for frees it
+//   was handed, giving the free end of the heap back to the kernel, a
+//   purge pass (see vikalloc_set_purge()), and flushing caches nobody
+//   has used since its last pass. While it runs, vikfree() of a block
+//   from the default heap only queues the block, and calls from other
+//   threads are safe, as with the caches.
+// Its work shows in the maint_* stats. A period of 0 stops it, after it
+//   finishes its queued frees.
+// Returns 0, or -1 with errno set if the thread can't be started.
+int vikalloc_set_maintenance(unsigned period_ms, unsigned budget_us);
+
+// Do one maintenance pass now, in the calling thread.
+void vikalloc_maintain(void);
+
+// Turn on the sampling heap profiler. On average, once every rate
+//   bytes allocated, vikalloc() records the size and a backtrace of the
+//   allocation. Passing 0 turns it off.
+// The rate trades detail for overhead. Rates of a few hundred KB keep
+//   the cost to a check and a subtraction on almost every call.
+void vikalloc_set_sample_rate(size_t rate);
+
+// Print the sampled allocations grouped by call site, biggest live
+//   bytes first, with the estimated live bytes, bytes allocated and
+//   allocation rate of each site, followed by its backtrace.
+// Passing NULL prints to the log stream.
+void vikalloc_profile_dump(FILE *);
+
+// Forget all samples and restart the clock for allocation rates.
+void vikalloc_profile_reset(void);
+
+// Time every vikalloc(), vikfree() and vikrealloc() call and count it
+//   in a log2 histogram for the path it took. Uses the TSC on x86 and
+//   clock_gettime() elsewhere. Turning it on clears the histograms.
+void vikalloc_set_latency_tracking(uint8_t);
+
+// Copy out the latency histograms. This is a single memcpy().
+void vikalloc_latency_get(vikalloc_latency_t *);
+
+// Clear the latency histograms.
+void vikalloc_latency_reset(void);
+
+// Print the call count, p50, p99, p999 and max latency of each path.
+// Passing NULL prints to the log stream.
+void vikalloc_latency_dump(FILE *);
+
+// Count the size of every vikalloc() request, in 16 byte buckets, for
+//   picking size classes with vikalloc_tune (see vikalloc_tune.c).
+//   Turning it on clears the counts.
+void vikalloc_set_size_histogram(uint8_t);
+
+// Print the size histogram as "size count" lines, one for each bucket
+//   that has any requests, after a couple of lines starting with #.
+//   This is the input vikalloc_tune reads.
+// Passing NULL prints to the log stream.
+void vikalloc_size_histogram_dump(FILE *);
+
+// Fill in statistics about the heap.
+void vikalloc_get_stats(vikalloc_stats_t *);
+
+// Create a heap of its own, so that one part of a program can't
+//   fragment the heap of another. Passing NULL uses the default options.
+//   The heap grows through its own reserved region instead of sbrk(),
+//   so it can't get in the way of the default heap either.
+// Returns NULL and sets errno if the region can't be reserved.
+vikheap_t *vikheap_create(const vikheap_options_t *);
+
+// Make a heap inside memory the caller already has, such as a static
+//   buffer, a shared memory segment or a pre-faulted mapping. The
+//   vikheap_t is kept at the start of the buffer and the rest is one
+//   free block to begin with. The heap never grows: an allocation that
+//   doesn't fit fails with ENOMEM, and no call on the heap makes a
+//   system call. vikheap_destroy() leaves the buffer alone.
+// Returns NULL and sets errno to EINVAL if the buffer is too small.
+vikheap_t *vikheap_init_from_buffer(void *buf, size_t len);
+
+// Make a heap in a shared memory segment, such as one from memfd_create()
+//   or shm_open(), that other processes can use with
+//   vikheap_attach_shared(). The segment is resized to len bytes and
+//   works like a vikheap_init_from_buffer() heap. It is mapped at addr,
+//   or wherever the kernel likes if addr is NULL, and the address is
+//   kept in the segment. Every process maps it there, so pointers into
+//   the heap can be passed between them as they are, and addr should be
+//   somewhere none of them is likely to be using. Calls on the heap take
+//   a process shared lock.
+// Returns NULL and sets errno if the segment can't be resized or mapped,
+//   or to EEXIST if something else is already at addr.
+vikheap_t *vikheap_create_shared(int fd, size_t len, void *addr);
+
+// Map a heap made by vikheap_create_shared() into this process.
+// Returns NULL and sets errno to EINVAL if fd doesn't hold a shared heap,
+//   or to EEXIST if something else is already at the heap's address.
+vikheap_t *vikheap_attach_shared(int fd);
+
+// One pointer kept in the heap, so that a process that attaches to it
+//   can find the objects another process put there.
+void vikheap_set_root(vikheap_t *, void *ptr);
+void *vikheap_get_root(vikheap_t *);
+
+// Open a heap kept in a file. A new or empty file is made len bytes
+//   long and formatted like a vikheap_init_from_buffer() heap. An
+//   existing one is mapped back in as it was left, with its blocks, free
+//   list and root, and len is ignored. It is checked first, and turned
+//   down if the lists don't hang together. If the address it was made at
+//   is taken, the heap is moved and its own pointers are fixed up, but
+//   pointers the program stored in its objects are not, so the root and
+//   vikheap_get_root() should be used to find them again.
+//   Only one process should have the file open at a time.
+//   vikheap_destroy() unmaps the heap and leaves the file.
+// Returns NULL and sets errno, to EINVAL if the file isn't a heap or
+//   fails the check.
+vikheap_t *vikheap_open_file(const char *path, size_t len);
+
+// Write a file heap's changes out to the file, with msync().
+// Returns 0, or -1 and sets errno.
+int vikheap_sync(vikheap_t *);
+
+// The heap that vikalloc() and the rest use.
+vikheap_t *vikheap_default(void);
+
+// The same as vikalloc(), vikfree(), vikcalloc() and vikrealloc(), on
+//   the given heap. A pointer must go back to the heap it came from.
+//   Medium objects (see vikalloc_set_medium()) only come from the
+//   default heap.
+void *vikheap_alloc(vikheap_t *, size_t size);
+void vikheap_free(vikheap_t *, void *ptr);
+void *vikheap_calloc(vikheap_t *, size_t nmemb, size_t size);
+void *vikheap_realloc(vikheap_t *, void *ptr, size_t size);
+
+// The same as vikalloc_reset(), vikalloc_dump2() and
+//   vikalloc_get_stats(), on the given heap.
+void vikheap_reset(vikheap_t *);
+void vikheap_dump(vikheap_t *, void *addr);
+void vikheap_get_stats(vikheap_t *, vikalloc_stats_t *);
+
+// Give all of a heap's memory back to the kernel. The default heap
+//   can't be destroyed, only reset. A shared heap is only unmapped from
+//   this process, and the segment stays as it is for the others.
+void vikheap_destroy(vikheap_t *);
+
+// A pool of objects that are all the same size.
+typedef struct vikpool_s vikpool_t;
+
+// Create a pool of object_size byte objects, each aligned to alignment
+//   bytes, which must be a power of two (0 means pointer alignment).
+// The pool carves its objects out of chunks it gets from vikalloc(), so
+//   objects have no header, and a free object holds the link to the
+//   next free object.
+// Returns NULL and sets errno to EINVAL for a bad size or alignment, or
+//   ENOMEM if the pool can't be allocated.
+vikpool_t *vikpool_create(size_t object_size, size_t alignment);
+
+// Get an object from the pool. Returns NULL and sets errno if a new
+//   chunk can't be allocated.
+void *vikpool_alloc(vikpool_t *);
+
+// Give an object back to its pool. Passing NULL does nothing.
+void vikpool_free(vikpool_t *, void *);
+
+// Free every chunk of the pool, and the pool. Every object from it is
+//   gone, as with vikalloc_reset(). vikalloc_reset() also frees every
+//   pool, and the pools can't be used after it.
+void vikpool_destroy(vikpool_t *);
+
+// A handle to an object that vikalloc_compact() is allowed to move.
+typedef struct vikhandle_s vikhandle_t;
+
+// Allocate size bytes reached through a handle instead of a pointer.
+//   The object is a block of the heap, never a medium object.
+// Returns NULL and sets errno if there is no memory or no free handle.
+vikhandle_t *vikalloc_handle(size_t size);
+
+// The object's address. It stays good until the next call to
+//   vikalloc_compact(), and must not be passed to vikfree().
+void *vikhandle_get(vikhandle_t *);
+
+// Free a handle and its object. Passing NULL does nothing.
+void vikhandle_free(vikhandle_t *);
+
+// Compact the heap: slide the objects of handles down into the free
+//   blocks below them, so the free space collects at the end of the
+//   heap, then give the free block at the end back to the kernel.
+//   Blocks from vikalloc() stay where they are. Each call runs for about
+//   budget_us microseconds and picks up where the last one stopped, so
+//   a pass can be spread over idle moments. A budget of 0 runs a whole
+//   pass. Nothing moves while a checkpoint is open.
+// Returns TRUE once a pass is finished.
+uint8_t vikalloc_compact(unsigned budget_us);
+
 #endif // __VIKALLOC_H
@@ -29,7 +29,7 @@ vikalloc_dump2(void *addr)
             , "excess   "
             , "status   "
         );
-    for (curr = block_list_head, i = 0; curr != NULL; curr = curr->next, i++) {
+    for (curr = cur_heap->block_list_head, i = 0; curr != NULL; curr = curr->next, i++) {
         fprintf(vikalloc_log_stream
                 , "  %u\t\t"
                   PTR_T PTR_T PTR_T PTR_T
@@ -48,8 +48,8 @@ vikalloc_dump2(void *addr)
                 , IS_FREE(curr) ? "free  " : "in use"
                 , IS_FREE(curr) ? '*' : ' '
             );
-        if (NEXT_FIT == fit_algorithm) {
-            if (curr == next_fit) {
+        if (NEXT_FIT == FIT_ALGORITHM) {
+            if (curr == cur_heap->next_fit) {
                 fprintf(vikalloc_log_stream, " <");
             }
             else {
@@ -83,9 +83,9 @@ vikalloc_dump2(void *addr)
               "   Total bytes: %lu"
               "   Block size: %zu bytes\n"
             , used_blocks, free_blocks
-            , (low_water_mark ? (low_water_mark - addr) : 0x0)
-            , (high_water_mark ? (high_water_mark - addr) : 0x0)
-            , (high_water_mark - low_water_mark)
+            , (cur_heap->low_water_mark ? (cur_heap->low_water_mark - addr) : 0x0)
+            , (cur_heap->high_water_mark ? (cur_heap->high_water_mark - addr) : 0x0)
+            , (cur_heap->high_water_mark - cur_heap->low_water_mark)
             , BLOCK_SIZE
         );
     //fprintf(vikalloc_log_stream, "  next_fit = " PTR " ***\n", (long) (((void *) next_fit) - addr));
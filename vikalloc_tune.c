@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "vikalloc.h"
+
+// Works out the size classes for the small object caches and the medium
+// object engine from the request sizes of a real workload, and writes
+// them out as vikalloc_size_classes.h:
+//   gcc -O2 vikalloc_tune.c -o vikalloc_tune
+//   ./vikalloc_tune histogram.txt > vikalloc_size_classes.h
+// The input is a histogram from vikalloc_size_histogram_dump(), with
+// "size count" on each line, or a trace with one request size per line.
+// Lines that start with # are skipped. -d writes the built-in classes.
+//
+// A request is rounded up to the smallest class that holds it. For a
+// given number of classes, the boundaries are picked by dynamic
+// programming to waste the fewest bytes over the whole workload: the
+// rounding, plus for medium classes the end of each run that no slot
+// fits in, shared between the slots of the run. The header in front of
+// every cached block is the same whatever the classes, so it is in the
+// report but can't change the choice, and neither can the rounding up
+// to the granule, so that is left out.
+
+#define CACHE_SLOTS (CACHE_MAX_SIZE / CACHE_GRANULE)
+#define MEDIUM_SLOTS (MEDIUM_MAX_SIZE / MEDIUM_GRANULE)
+
+// The most classes a table can have, since the index holds a uint8_t.
+#define MAX_CLASSES 255
+
+// Requests, by size rounded up to the granule of their table.
+static double cache_counts[CACHE_SLOTS + 1];
+static double medium_counts[MEDIUM_SLOTS + 1];
+static double cache_sums[CACHE_SLOTS + 1];
+static double medium_sums[MEDIUM_SLOTS + 1];
+static double cache_weights[CACHE_SLOTS + 1];
+static double medium_weights[MEDIUM_SLOTS + 1];
+
+typedef struct table_s {
+    const char *name;      // cache or medium, for the names in the header
+    const char *upper;     // CACHE or MEDIUM
+    size_t granule;
+    size_t min_size;       // the smallest class that can be picked
+    size_t max_size;       // the largest class, which is always there
+    double *counts;
+    double *sums;          // sums[i] is the requests up to i granules
+    double *weights;       // and weights[i] is those times their granules
+    size_t nclasses;
+    size_t sizes[MAX_CLASSES];
+} table_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-d] [-c classes] [-m classes] [file ...]\n", prog);
+    fprintf(stderr, "  -d         : write the built-in classes, ignoring any input\n");
+    fprintf(stderr, "  -c classes : number of cache classes (default %d)\n", CACHE_SLOTS);
+    fprintf(stderr, "  -m classes : number of medium classes (default 29)\n");
+    exit(EXIT_FAILURE);
+}
+
+// Adds the requests on one line, if it has any.
+static void read_line(const char *line) {
+    char *end = NULL;
+    unsigned long long size = 0;
+    double count = 1;
+
+    while (isspace((unsigned char) *line)) {
+        line++;
+    }
+    if ('#' == *line || '\0' == *line) {
+        return;
+    }
+    size = strtoull(line, &end, 10);
+    if (end == line || 0 == size) {
+        return;
+    }
+    if (*end != '\0' && *end != '\n') {
+        count = strtod(end, NULL);
+    }
+    if (size <= CACHE_MAX_SIZE) {
+        cache_counts[(size + CACHE_GRANULE - 1) / CACHE_GRANULE] += count;
+    }
+    // A request of MEDIUM_MIN_SIZE goes to the caches when they are on
+    // and the medium engine when they aren't, so it counts for both.
+    if (size >= MEDIUM_MIN_SIZE && size <= MEDIUM_MAX_SIZE) {
+        medium_counts[(size + MEDIUM_GRANULE - 1) / MEDIUM_GRANULE] += count;
+    }
+}
+
+static void read_file(FILE *stream) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        read_line(line);
+    }
+}
+
+// The bytes wasted per object in a slot of this size, besides rounding.
+static double slot_overhead(const table_t *table, size_t size) {
+    if (table->counts == medium_counts) {
+        return (double) (MEDIUM_RUN_SIZE % size) / (double) (MEDIUM_RUN_SIZE / size);
+    }
+    return 0;
+}
+
+// Fills in sums and weights, so class_cost() doesn't have to walk the
+// counts.
+static void table_sum(table_t *table) {
+    size_t i = 0;
+
+    table->sums[0] = table->counts[0];
+    table->weights[0] = 0;
+    for (i = 1; i * table->granule <= table->max_size; i++) {
+        table->sums[i] = table->sums[i - 1] + table->counts[i];
+        table->weights[i] = table->weights[i - 1] + table->counts[i] * (double) i;
+    }
+}
+
+// The bytes wasted by the requests from lo (exclusive) to hi (inclusive)
+// granules when they all go in a class of hi granules.
+static double class_cost(const table_t *table, size_t lo, size_t hi) {
+    double requests = table->sums[hi] - table->sums[lo];
+    double granules = table->weights[hi] - table->weights[lo];
+
+    return ((double) hi * requests - granules) * (double) table->granule
+        + requests * slot_overhead(table, hi * table->granule);
+}
+
+// The bytes a set of classes would waste on the workload.
+static double table_cost(const table_t *table, const size_t *sizes, size_t nclasses) {
+    double cost = 0;
+    size_t lo = 0;
+    size_t i = 0;
+
+    for (i = 0; i < nclasses; i++) {
+        cost += class_cost(table, lo, sizes[i] / table->granule);
+        lo = sizes[i] / table->granule;
+    }
+    return cost;
+}
+
+static double table_requests(const table_t *table) {
+    double total = 0;
+    size_t i = 0;
+
+    for (i = 0; i * table->granule <= table->max_size; i++) {
+        total += table->counts[i];
+    }
+    return total;
+}
+
+// The classes vikalloc has always had: every multiple of CACHE_GRANULE
+// for the caches, and quarter steps between powers of two for medium
+// objects, 256, 320, 384, 448, 512, 640, ... 32768.
+static void default_classes(table_t *table) {
+    size_t size = 0;
+    size_t step = 0;
+
+    table->nclasses = 0;
+    if (table->counts == cache_counts) {
+        for (size = CACHE_GRANULE; size <= CACHE_MAX_SIZE; size += CACHE_GRANULE) {
+            table->sizes[table->nclasses++] = size;
+        }
+        return;
+    }
+    table->sizes[table->nclasses++] = MEDIUM_MIN_SIZE;
+    for (size = MEDIUM_MIN_SIZE; size < MEDIUM_MAX_SIZE; size *= 2) {
+        for (step = 1; step <= 4; step++) {
+            table->sizes[table->nclasses++] = size + (size / 4) * step;
+        }
+    }
+}
+
+// Picks nclasses boundaries. best[k][j] is the least waste for the
+// requests up to j granules with k classes, the last one j granules.
+static void tune_classes(table_t *table, size_t nclasses) {
+    size_t first = (table->min_size + table->granule - 1) / table->granule;
+    size_t last = table->max_size / table->granule;
+    size_t slots = last + 1;
+    double *best = NULL;
+    size_t *from = NULL;
+    double prior = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+    if (nclasses > last - first + 1) {
+        nclasses = last - first + 1;
+    }
+    // A workload that never makes some sizes still gets classes for
+    // them, spread out as if requests fell off with size.
+    prior = (table_requests(table) + 1) * 1e-9;
+    for (i = first; i <= last; i++) {
+        table->counts[i] += prior / (double) i;
+    }
+    table_sum(table);
+
+    best = calloc(nclasses * slots, sizeof(double));
+    from = calloc(nclasses * slots, sizeof(size_t));
+    if (NULL == best || NULL == from) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (j = first; j <= last; j++) {
+        best[j] = class_cost(table, 0, j);
+    }
+    for (k = 1; k < nclasses; k++) {
+        for (j = first + k; j <= last; j++) {
+            best[k * slots + j] = HUGE_VAL;
+            for (i = first + k - 1; i < j; i++) {
+                double cost = best[(k - 1) * slots + i] + class_cost(table, i, j);
+
+                if (cost < best[k * slots + j]) {
+                    best[k * slots + j] = cost;
+                    from[k * slots + j] = i;
+                }
+            }
+        }
+    }
+    table->nclasses = nclasses;
+    for (k = nclasses, j = last; k > 0; k--) {
+        table->sizes[k - 1] = j * table->granule;
+        j = from[(k - 1) * slots + j];
+    }
+    free(best);
+    free(from);
+}
+
+// The waste per request, less the rounding to the granule, which no
+// choice of classes can save. The sums can leave it a hair below zero.
+static double per_request(const table_t *table, const size_t *sizes, size_t nclasses
+                          , double requests) {
+    double cost = table_cost(table, sizes, nclasses) / requests;
+
+    return (cost < 0) ? 0 : cost;
+}
+
+static void report(const table_t *table) {
+    table_t builtin = *table;
+    double requests = table_requests(table);
+    double header = (table->counts == cache_counts) ? (double) sizeof(heap_block_t) : 0;
+
+    default_classes(&builtin);
+    fprintf(stderr, "%s: %zu classes for %.0f requests\n", table->name
+            , table->nclasses, requests);
+    if (requests < 1) {
+        return;
+    }
+    fprintf(stderr, "  waste per request: %.1f bytes (built-in %.1f), plus %.0f of header\n"
+            , per_request(table, table->sizes, table->nclasses, requests)
+            , per_request(&builtin, builtin.sizes, builtin.nclasses, requests)
+            , header);
+}
+
+static void write_table(FILE *stream, const table_t *table) {
+    size_t cls = 0;
+    size_t i = 0;
+
+    fprintf(stream, "# define %s_CLASSES %zu\n\n", table->upper, table->nclasses);
+    fprintf(stream, "static const uint32_t %s_class_sizes[%s_CLASSES] = {", table->name
+            , table->upper);
+    for (i = 0; i < table->nclasses; i++) {
+        fprintf(stream, "%s%s%zu", (i != 0) ? "," : "", (i % 8 == 0) ? "\n    " : " "
+                , table->sizes[i]);
+    }
+    fprintf(stream, "\n};\n\n");
+    fprintf(stream, "static const uint8_t %s_class_index[%s_MAX_SIZE / %s_GRANULE + 1] = {"
+            , table->name, table->upper, table->upper);
+    for (i = 0; i * table->granule <= table->max_size; i++) {
+        while (table->sizes[cls] < i * table->granule) {
+            cls++;
+        }
+        fprintf(stream, "%s%s%zu", (i != 0) ? "," : "", (i % 16 == 0) ? "\n    " : " ", cls);
+    }
+    fprintf(stream, "\n};\n\n");
+}
+
+int main(int argc, char *argv[]) {
+    table_t cache = {"cache", "CACHE", CACHE_GRANULE, CACHE_GRANULE, CACHE_MAX_SIZE
+                     , cache_counts, cache_sums, cache_weights, 0, {0}};
+    table_t medium = {"medium", "MEDIUM", MEDIUM_GRANULE, MEDIUM_MIN_SIZE, MEDIUM_MAX_SIZE
+                      , medium_counts, medium_sums, medium_weights, 0, {0}};
+    size_t cache_classes = CACHE_SLOTS;
+    size_t medium_classes = 29;
+    int builtin = 0;
+    int files = 0;
+    int i = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "-d")) {
+            builtin = 1;
+        } else if (0 == strcmp(argv[i], "-c") && i + 1 < argc) {
+            cache_classes = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "-m") && i + 1 < argc) {
+            medium_classes = strtoul(argv[++i], NULL, 10);
+        } else if ('-' == argv[i][0]) {
+            usage(argv[0]);
+        } else {
+            FILE *stream = fopen(argv[i], "r");
+
+            if (NULL == stream) {
+                perror(argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            read_file(stream);
+            fclose(stream);
+            files++;
+        }
+    }
+    if (cache_classes < 1 || cache_classes > MAX_CLASSES
+        || medium_classes < 1 || medium_classes > MAX_CLASSES) {
+        usage(argv[0]);
+    }
+    if (builtin) {
+        default_classes(&cache);
+        default_classes(&medium);
+    } else {
+        if (0 == files) {
+            read_file(stdin);
+        }
+        tune_classes(&cache, cache_classes);
+        tune_classes(&medium, medium_classes);
+        report(&cache);
+        report(&medium);
+    }
+
+    printf("// Size classes for vikalloc, written by vikalloc_tune.c. Run it again\n");
+    printf("// instead of editing this.\n");
+    printf("// %s\n", builtin ? "These are the built-in classes."
+           : "These are tuned to a recorded workload.");
+    printf("//\n");
+    printf("// A request of size bytes goes in class\n");
+    printf("//   index[(size + GRANULE - 1) / GRANULE]\n");
+    printf("// whose objects are sizes[class] bytes. Only vikalloc.c includes this.\n\n");
+    printf("#ifndef __VIKALLOC_SIZE_CLASSES_H\n");
+    printf("# define __VIKALLOC_SIZE_CLASSES_H\n\n");
+    write_table(stdout, &cache);
+    write_table(stdout, &medium);
+    printf("#endif // __VIKALLOC_SIZE_CLASSES_H\n");
+    return EXIT_SUCCESS;
+}